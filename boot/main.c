@@ -8,6 +8,7 @@
  */
 #include <inc/x86.h>
 #include <inc/elf.h>
+#include <inc/multiboot.h>
 
 /**********************************************************************
  * This a dirt simple boot loader, whose sole job is to boot
@@ -39,6 +40,7 @@
 
 #define SECTSIZE	512
 #define ELFHDR		((elfhdr *) 0x10000) // scratch space
+#define E820MAP		0x7e00	// memory map left by boot.S
 
 void readsect(void*, uint32_t);
 void readseg(uint32_t, uint32_t, uint32_t);
@@ -61,9 +63,17 @@ bootmain(void)
 	for (; ph < eph; ph++)
 		readseg(ph->p_va, ph->p_memsz, ph->p_offset);
 
+	// pass the BIOS memory map that boot.S collected to the kernel
+	// the same way a Multiboot boot loader such as GRUB would
+	multiboot_info mbi;
+	mbi.flags = MULTIBOOT_INFO_MMAP;
+	mbi.mmap_addr = E820MAP + 4;
+	mbi.mmap_length = *(uint16_t *) E820MAP - (E820MAP + 8);
+
 	// call the entry point from the ELF header
 	// note: does not return!
-	((void (*)(void)) (ELFHDR->e_entry & 0xFFFFFF))();
+	asm volatile("jmp *%0" : : "d" (ELFHDR->e_entry & 0xFFFFFF),
+		"a" (MULTIBOOT_BOOTLOADER_MAGIC), "b" (&mbi));
 
 bad:
 	outw(0x8A00, 0x8A00);
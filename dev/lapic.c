@@ -0,0 +1,253 @@
+/*
+ * The local APIC manages internal (non-I/O) interrupts,
+ * and lets processors send each other interprocessor interrupts (IPIs).
+ * See Chapter 8 & Appendix C of Intel processor manual volume 3.
+ *
+ * Copyright (c) 2006-2009 Frans Kaashoek, Robert Morris, Russ Cox,
+ *                         Massachusetts Institute of Technology
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Derived from xv6.
+ * Adapted for PIOS by Bryan Ford at Yale University.
+ */
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/cpu.h>
+#include <kern/trap.h>
+
+#include <dev/lapic.h>
+#include <dev/nvram.h>
+
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+	#define BUSY       0x00001000
+	#define FIXED      0x00000000
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define PERIODIC   0x00020000   // Periodic
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+
+// PC speaker port, whose bits gate and report on PIT channel 2.
+#define IO_PORTB	0x61
+#define IO_TIMER1	0x40		// 8253 Timer #1
+#define TIMER_FREQ	1193182		// PIT input clock, in Hz
+
+volatile uint32_t *lapic;		// Initialized in mp.c
+uint32_t lapic_tsckhz;
+uint32_t lapic_timerkhz;
+
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+// Wait for an IPI we've sent to be delivered.
+static void
+lapic_icrwait(void)
+{
+	while (lapic[ICRLO] & DELIVS)
+		pause();
+}
+
+// Measure the TSC rate, by counting TSC ticks
+// while PIT channel 2 counts down for 10ms.
+static void
+lapic_calibrate(void)
+{
+	const uint32_t latch = TIMER_FREQ / 100;
+
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01); // gate on, speaker off
+	outb(IO_TIMER1+3, 0xb0);	// channel 2, lo/hi byte, mode 0, binary
+	outb(IO_TIMER1+2, latch & 0xff);
+	outb(IO_TIMER1+2, latch >> 8);
+	uint64_t t0 = rdtsc();
+	while (!(inb(IO_PORTB) & 0x20))	// OUT2 rises at terminal count
+		;
+	lapic_tsckhz = (rdtsc() - t0) / 10;
+}
+
+// Measure the local APIC timer's rate against the TSC,
+// by letting it count down undivided for 1ms.
+static void
+lapic_timercalibrate(void)
+{
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xffffffff);
+	uint64_t end = rdtsc() + lapic_tsckhz;
+	while (rdtsc() < end)
+		;
+	lapic_timerkhz = 0xffffffff - lapic[TCCR];
+	lapicw(TICR, 0);
+}
+
+// Ignore spurious interrupts, as the local APIC expects: no EOI.
+static void
+lapic_spurious(trapframe *tf)
+{
+}
+
+void
+lapic_init()
+{
+	if (cpu_onboot())
+		lapic_calibrate();
+	if (!lapic)
+		return;
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
+
+	// Leave the timer off until someone needs it (see lapic_timer()).
+	// All CPUs' timers run at the same rate, so measure just one.
+	if (cpu_onboot()) {
+		lapic_timercalibrate();
+		trap_register(T_IRQ0 + IRQ_SPURIOUS, lapic_spurious);
+	}
+	lapicw(TIMER, MASKED);
+
+	// Leave LINT0 of the BSP enabled so that it can get
+	// interrupts from the 8259A chip; mask it on all other CPUs.
+	if (!cpu_onboot())
+		lapicw(LINT0, MASKED);
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to T_LERROR.
+	lapicw(ERROR, T_LERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+}
+
+uint32_t
+lapic_id(void)
+{
+	if (lapic)
+		return lapic[ID] >> 24;
+	return 0;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+void
+lapic_timer(uint32_t hz)
+{
+	if (!lapic)
+		return;
+	if (hz == 0) {
+		lapicw(TIMER, MASKED);
+		lapicw(TICR, 0);
+		return;
+	}
+	assert(lapic_timerkhz != 0);
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | T_LTIMER);
+	lapicw(TICR, MAX((uint64_t) lapic_timerkhz * 1000 / hz, 1));
+}
+
+void
+lapic_microdelay(uint32_t us)
+{
+	assert(lapic_tsckhz != 0);
+	uint64_t end = rdtsc() + (uint64_t)us * lapic_tsckhz / 1000;
+	while (rdtsc() < end)
+		pause();
+}
+
+// Start all other processors at once, running code at physical addr.
+// This is the "universal startup algorithm" of the MultiProcessor
+// Specification, Appendix B.4.1, except that instead of going through
+// it once per processor, we broadcast each IPI to all processors
+// but ourselves: that way, the whole sequence of delays costs us
+// the same no matter how many processors there are,
+// and they all go through their startup code in parallel.
+uint64_t
+lapic_startcpus(uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	assert(lapic != NULL);
+	assert(addr % PAGESIZE == 0 && addr < 0x100000);
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t*)(0x40<<4 | 0x67);  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// INIT IPI to everyone else: assert, then deassert.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, OTHERS | INIT | LEVEL | ASSERT);
+	lapic_icrwait();
+	lapic_microdelay(10000);
+	lapicw(ICRLO, OTHERS | INIT | LEVEL);
+	lapic_icrwait();
+	lapic_microdelay(100);
+
+	// Send startup IPI (twice!) to enter bootstrap code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRLO, OTHERS | STARTUP | (addr >> 12));
+		lapic_icrwait();
+		lapic_microdelay(200);
+	}
+	return t0;
+}
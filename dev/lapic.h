@@ -0,0 +1,56 @@
+/*
+ * Local APIC (Advanced Programmable Interrupt Controller) definitions.
+ * See Chapter 8 & Appendix C of Intel processor manual volume 3.
+ *
+ * Copyright (c) 2006-2009 Frans Kaashoek, Robert Morris, Russ Cox,
+ *                         Massachusetts Institute of Technology
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Derived from xv6.
+ * Adapted for PIOS by Bryan Ford at Yale University.
+ */
+
+#ifndef PIOS_DEV_LAPIC_H
+#define PIOS_DEV_LAPIC_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// Default physical address of every CPU's local APIC.
+#define LAPIC_DEFAULT	0xfee00000
+
+// Address of the local APIC, as found by mp_init(); NULL if none.
+extern volatile uint32_t *lapic;
+
+// TSC ticks per millisecond, as measured by lapic_init().
+extern uint32_t lapic_tsckhz;
+
+// Local APIC timer ticks per millisecond, likewise.
+extern uint32_t lapic_timerkhz;
+
+// Set up the current CPU's local APIC.
+void lapic_init(void);
+
+// Acknowledge the interrupt being serviced.
+void lapic_eoi(void);
+
+// Return the current CPU's local APIC ID.
+uint32_t lapic_id(void);
+
+// Interrupt the current CPU hz times a second at vector T_LTIMER,
+// or stop doing so if hz is zero.
+void lapic_timer(uint32_t hz);
+
+// Spin for at least the given number of microseconds.
+void lapic_microdelay(uint32_t us);
+
+// Start all other CPUs at once, running code at physical address addr,
+// which must be page-aligned and below 1MB.
+// Returns the TSC value when the first STARTUP IPI went out.
+uint64_t lapic_startcpus(uint32_t addr);
+
+
+#endif /* !PIOS_DEV_LAPIC_H */
@@ -0,0 +1,58 @@
+/*
+ * Multiboot boot information structures,
+ * as defined by the Multiboot Specification version 0.6.96.
+ * The kernel gets these from a Multiboot-compliant boot loader such as GRUB,
+ * or from boot/main.c, which builds them from the BIOS's E820 memory map.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_MULTIBOOT_H
+#define PIOS_INC_MULTIBOOT_H
+
+// Value the boot loader passes in EAX to indicate Multiboot compliance.
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// Flags in multiboot_info.flags indicating which fields are valid
+#define MULTIBOOT_INFO_MEMORY	0x00000001	// mem_lower, mem_upper
+#define MULTIBOOT_INFO_CMDLINE	0x00000004	// cmdline
+#define MULTIBOOT_INFO_MMAP	0x00000040	// mmap_length, mmap_addr
+
+// Memory map region types: anything but "available" is off-limits.
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/cdefs.h>
+
+
+// Boot information structure the boot loader passes in EBX.
+typedef struct multiboot_info {
+	uint32_t	flags;		// Which of the fields below are valid
+	uint32_t	mem_lower;	// KB of memory below 1MB
+	uint32_t	mem_upper;	// KB of memory above 1MB
+	uint32_t	boot_device;
+	uint32_t	cmdline;	// Physical address of command line string
+	uint32_t	mods_count;
+	uint32_t	mods_addr;
+	uint32_t	syms[4];
+	uint32_t	mmap_length;	// Size in bytes of the memory map
+	uint32_t	mmap_addr;	// Physical address of the memory map
+} multiboot_info;
+
+// One region in the memory map.
+// Entries are variable-length: each one's size field gives
+// the number of bytes that follow it, not including the size field itself.
+// A BIOS E820 memory map entry is exactly the part after the size field.
+typedef struct multiboot_mmap {
+	uint32_t	size;		// Size of the rest of this entry
+	uint64_t	base;		// Physical start address of region
+	uint64_t	length;		// Size of region in bytes
+	uint32_t	type;		// MULTIBOOT_MEMORY_* region type
+} gcc_packed multiboot_mmap;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !PIOS_INC_MULTIBOOT_H */
@@ -0,0 +1,60 @@
+/*
+ * PIOS system call definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_INC_SYSCALL_H
+#define PIOS_INC_SYSCALL_H
+
+#include <inc/types.h>
+#include <inc/trap.h>
+
+
+// System call numbers, passed in EAX.
+#define SYS_NULL	0	// Do nothing; for measuring syscall overhead
+#define SYS_CPUTS	1	// Write a string to the console
+#define SYS_CGETC	2	// Poll for a console character, or return 0
+#define SYS_NCALLS	3
+
+// Return value of an unknown system call.
+#define SYS_EINVAL	((uint32_t) -1)
+
+
+// System calls take a call number in EAX and up to three arguments
+// in EBX, ESI, and EDI, and return a result in EAX.
+// There are two ways to make one.
+
+// The general-purpose way, through the T_SYSCALL trap gate,
+// which works on every processor but costs a full trap and IRET.
+static gcc_inline uint32_t
+syscall_int(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	uint32_t ret;
+	asm volatile("int %1"
+		: "=a" (ret)
+		: "i" (T_SYSCALL), "a" (num), "b" (a1), "S" (a2), "D" (a3)
+		: "cc", "memory");
+	return ret;
+}
+
+// The fast way, through SYSENTER, which skips the IDT and trapframe
+// but works only on processors that support it (CPUID_EDX_SEP).
+// SYSEXIT returns to the EIP in EDX with the ESP in ECX,
+// so we pass those to the kernel, which then clobbers them.
+static gcc_inline uint32_t
+syscall_sysenter(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	uint32_t ret, dummy1, dummy2;
+	asm volatile("movl %%esp,%%ecx; leal 1f,%%edx; sysenter; 1:"
+		: "=a" (ret), "=&c" (dummy1), "=&d" (dummy2)
+		: "a" (num), "b" (a1), "S" (a2), "D" (a3)
+		: "cc", "memory");
+	return ret;
+}
+
+
+#endif /* !PIOS_INC_SYSCALL_H */
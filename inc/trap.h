@@ -142,4 +142,7 @@ typedef gcc_aligned(16) struct fxsave {
 // A static_assert in kern/trap.c checks this.
 #define SIZEOF_STRUCT_TRAPFRAME	0x4c
 
+// Must equal 'offsetof(struct trapframe, gs)', for kern/trapasm.S.
+#define OFFSETOF_TRAPFRAME_GS	0x20
+
 #endif /* !PIOS_INC_TRAP_H */
@@ -47,6 +47,12 @@ typedef struct cpuinfo {
 	uint32_t	ecx;
 } cpuinfo;
 
+// Processor feature flags returned in EDX by CPUID function 1
+#define CPUID_EDX_PSE	0x00000008	// 4MB page size extensions
+#define CPUID_EDX_SEP	0x00000800	// SYSENTER/SYSEXIT instructions
+#define CPUID_EDX_PGE	0x00002000	// Global pages
+#define CPUID_EDX_SSE2	0x04000000	// SSE2 extensions, including MOVNTI
+
 
 
 static gcc_inline void
@@ -271,6 +277,25 @@ read_cs(void)
         return cs;
 }
 
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// Kernel CS for SYSENTER
+#define MSR_SYSENTER_ESP	0x175	// Kernel ESP for SYSENTER
+#define MSR_SYSENTER_EIP	0x176	// Kernel EIP for SYSENTER
+
+static gcc_inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static gcc_inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 // Atomically set *addr to newval and return the old value of *addr.
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
@@ -285,6 +310,35 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically compare *addr with oldval, and if they're equal set it to newval.
+// Returns the value *addr held before, which equals oldval on success.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0" :
+	       "+m" (*addr), "=a" (result) :
+	       "r" (newval), "1" (oldval) :
+	       "cc");
+	return result;
+}
+
+// 64-bit version of cmpxchg() using the Pentium's cmpxchg8b instruction,
+// e.g., for updating a pointer together with a version counter.
+static inline uint64_t
+cmpxchg8b(volatile uint64_t *addr, uint64_t oldval, uint64_t newval)
+{
+	uint64_t result;
+
+	asm volatile("lock; cmpxchg8b %0" :
+	       "+m" (*addr), "=A" (result) :
+	       "b" ((uint32_t) newval), "c" ((uint32_t) (newval >> 32)),
+	       "1" (oldval) :
+	       "cc");
+	return result;
+}
+
 // Atomically add incr to *addr.
 static inline void
 lockadd(volatile int32_t *addr, int32_t incr)
@@ -304,6 +358,22 @@ lockaddz(volatile int32_t *addr, int32_t incr)
 	return zero;
 }
 
+// Atomically set the given bits in the 16-bit word at *addr.
+static inline void
+lockorw(volatile uint16_t *addr, uint16_t bits)
+{
+	asm volatile("lock; orw %1,%0" : "+m" (*addr) : "ri" (bits)
+		: "cc", "memory");
+}
+
+// Atomically clear all but the given bits in the 16-bit word at *addr.
+static inline void
+lockandw(volatile uint16_t *addr, uint16_t bits)
+{
+	asm volatile("lock; andw %1,%0" : "+m" (*addr) : "ri" (bits)
+		: "cc", "memory");
+}
+
 // Atomically add incr to *addr and return the old value of *addr.
 static inline int32_t
 xadd(volatile uint32_t *addr, int32_t incr)
@@ -311,7 +381,7 @@ xadd(volatile uint32_t *addr, int32_t incr)
 	int32_t result;
 
 	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile("lock; xaddl %0, %1" :
+	asm volatile("lock; xaddl %1, %0" :
 	       "+m" (*addr), "=a" (result) :
 	       "1" (incr) :
 	       "cc");
@@ -333,6 +403,16 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+// CPUID for functions such as 4 that take a subfunction index in ECX.
+static gcc_inline void
+cpuid_sub(uint32_t idx, uint32_t sub, cpuinfo *info)
+{
+	asm volatile("cpuid" 
+		: "=a" (info->eax), "=b" (info->ebx),
+		  "=c" (info->ecx), "=d" (info->edx)
+		: "a" (idx), "c" (sub));
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
@@ -0,0 +1,214 @@
+/*
+ * Finding processors and interrupt controllers from ACPI tables.
+ * The MultiProcessor Specification's tables (see kern/mp.c) are obsolete:
+ * firmware may omit them, or list only a limited number of processors,
+ * whereas the ACPI Multiple APIC Description Table (MADT) lists them all.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/mp.h>
+#include <kern/acpi.h>
+
+#include <dev/lapic.h>
+
+
+int acpi_nioapic;
+acpi_ioapicinfo acpi_ioapic[ACPI_MAXIOAPIC];
+uint32_t acpi_irqgsi[16];
+uint16_t acpi_irqflags[16];
+int acpi_ncpu;
+
+
+static uint8_t
+acpi_sum(void *addr, int len)
+{
+	uint8_t *p = addr, sum = 0;
+	int i;
+	for (i = 0; i < len; i++)
+		sum += p[i];
+	return sum;
+}
+
+// Look for the RSDP in the len bytes at physical address addr,
+// on 16-byte boundaries as the spec requires.
+static acpi_rsdp *
+acpi_rsdpsearch1(uint32_t addr, int len)
+{
+	uint8_t *p = mem_ptr(addr), *e = mem_ptr(addr + len);
+	for (; p < e; p += 16) {
+		acpi_rsdp *rsdp = (acpi_rsdp *) p;
+		if (memcmp(p, "RSD PTR ", 8) != 0 || acpi_sum(p, 20) != 0)
+			continue;
+		if (rsdp->revision >= 2
+				&& acpi_sum(p, rsdp->length) != 0)
+			continue;
+		return rsdp;
+	}
+	return NULL;
+}
+
+// The RSDP is either in the first KB of the EBDA,
+// or in the BIOS ROM area between 0xE0000 and 0xFFFFF.
+static acpi_rsdp *
+acpi_rsdpsearch(void)
+{
+	uint8_t *bda = mem_ptr(0x400);
+	uint32_t ebda = ((bda[0x0F] << 8) | bda[0x0E]) << 4;
+	acpi_rsdp *rsdp;
+	if (ebda != 0 && (rsdp = acpi_rsdpsearch1(ebda, 1024)) != NULL)
+		return rsdp;
+	return acpi_rsdpsearch1(0xE0000, 0x20000);
+}
+
+// Check a system description table's signature and checksum.
+static acpi_sdt *
+acpi_sdtcheck(uint32_t addr, const char *sig)
+{
+	acpi_sdt *sdt = mem_ptr(addr);
+	if (addr == 0 || memcmp(sdt->signature, sig, 4) != 0
+			|| acpi_sum(sdt, sdt->length) != 0)
+		return NULL;
+	return sdt;
+}
+
+// Find the MADT through the XSDT if there is one, otherwise the RSDT.
+// We can only reach tables in the low 4GB of physical memory.
+static acpi_sdt *
+acpi_findmadt(void)
+{
+	acpi_rsdp *rsdp = acpi_rsdpsearch();
+	if (rsdp == NULL)
+		return NULL;
+
+	acpi_sdt *xsdt = NULL, *rsdt, *madt;
+	if (rsdp->revision >= 2 && (rsdp->xsdtaddr >> 32) == 0)
+		xsdt = acpi_sdtcheck(rsdp->xsdtaddr, "XSDT");
+	if (xsdt != NULL) {
+		uint64_t *ent = (uint64_t *) xsdt->data;
+		int i, n = (xsdt->length - sizeof(acpi_sdt)) / 8;
+		for (i = 0; i < n; i++)
+			if ((ent[i] >> 32) == 0 && (madt =
+					acpi_sdtcheck(ent[i], "APIC")) != NULL)
+				return madt;
+	}
+	if ((rsdt = acpi_sdtcheck(rsdp->rsdtaddr, "RSDT")) != NULL) {
+		uint32_t *ent = (uint32_t *) rsdt->data;
+		int i, n = (rsdt->length - sizeof(acpi_sdt)) / 4;
+		for (i = 0; i < n; i++)
+			if ((madt = acpi_sdtcheck(ent[i], "APIC")) != NULL)
+				return madt;
+	}
+	return NULL;
+}
+
+bool
+acpi_init(void)
+{
+	acpi_sdt *sdt = acpi_findmadt();
+	if (sdt == NULL)
+		return false;
+	acpi_madt *madt = (acpi_madt *) sdt->data;
+	uint8_t *p, *e = (uint8_t *) sdt + sdt->length;
+	int i, ncpu = 1, nskip = 0, nover = 0;	// ncpu counts the boot CPU
+
+	for (i = 0; i < 16; i++) {
+		acpi_irqgsi[i] = i;
+		acpi_irqflags[i] = 0;
+	}
+
+	// The local APIC address comes first, in case an entry overrides it:
+	// we need it to tell which processor entry is the boot CPU.
+	uint64_t lapicaddr = madt->lapicaddr;
+	for (p = madt->entries; p + 2 <= e && p[1] >= 2; p += p[1])
+		if (p[0] == MADT_LAPICADDR)
+			lapicaddr = ((madt_lapicaddr *) p)->addr;
+	if ((lapicaddr >> 32) != 0) {
+		warn("acpi_init: local APIC above 4GB");
+		return false;
+	}
+	lapic = mem_ptr((uint32_t) lapicaddr);
+	uint32_t bootid = lapic_id();
+
+	madt_lapic *ml;
+	madt_x2apic *mx;
+	madt_ioapic *mi;
+	madt_iso *mo;
+	acpi_ncpu = 0;
+	for (p = madt->entries; p + 2 <= e && p[1] >= 2; p += p[1]) {
+		switch (p[0]) {
+		case MADT_LAPIC:
+			ml = (madt_lapic *) p;
+			if (!(ml->flags & MADT_ENABLED))
+				break;		// processor unusable
+			acpi_ncpu++;
+			if (ml->apicid == bootid)
+				break;
+
+			// Get a cpu struct and kernel stack for each non-boot CPU.
+			// Which one an AP actually gets is up to it:
+			// see boot/bootother.S.
+			if (ncpu >= CPU_MAX) {
+				nskip++;
+				break;
+			}
+			cpu_alloc();
+			ncpu++;
+			break;
+
+		case MADT_X2APIC:
+			// We drive local APICs in xAPIC mode, which can't
+			// address IDs beyond 254; firmware lists any CPUs
+			// with lower IDs in MADT_LAPIC entries as well.
+			mx = (madt_x2apic *) p;
+			if ((mx->flags & MADT_ENABLED) && mx->apicid >= 255)
+				nskip++;
+			break;
+
+		case MADT_IOAPIC:
+			mi = (madt_ioapic *) p;
+			if (acpi_nioapic == ACPI_MAXIOAPIC) {
+				warn("acpi_init: too many I/O APICs");
+				break;
+			}
+			acpi_ioapic[acpi_nioapic].apicid = mi->apicid;
+			acpi_ioapic[acpi_nioapic].addr = mi->addr;
+			acpi_ioapic[acpi_nioapic].gsibase = mi->gsibase;
+			acpi_nioapic++;
+			break;
+
+		case MADT_ISO:
+			mo = (madt_iso *) p;
+			if (mo->bus == 0 && mo->irq < 16) {
+				acpi_irqgsi[mo->irq] = mo->gsi;
+				acpi_irqflags[mo->irq] = mo->flags;
+				nover++;
+			}
+			break;
+		}
+	}
+	if (nskip > 0)
+		warn("acpi_init: ignoring %d CPUs beyond CPU_MAX (%d) "
+			"or xAPIC reach", nskip, CPU_MAX);
+
+	// Point mp.c's notion of the I/O APIC at the one handling GSI 0.
+	mp_ismp = 1;
+	for (i = 0; i < acpi_nioapic; i++)
+		if (acpi_ioapic[i].gsibase == 0) {
+			mp_ioapicid = acpi_ioapic[i].apicid;
+			mp_ioapic = mem_ptr(acpi_ioapic[i].addr);
+		}
+
+	cprintf("acpi_init: %d CPUs, %d I/O APICs, %d IRQs overridden\n",
+		acpi_ncpu, acpi_nioapic, nover);
+	return true;
+}
@@ -0,0 +1,130 @@
+/*
+ * ACPI table definitions, for finding processors and interrupt controllers.
+ * See the Advanced Configuration and Power Interface Specification,
+ * Revision 4.0, Chapter 5.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_ACPI_H
+#define PIOS_KERN_ACPI_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// Root System Description Pointer
+typedef struct acpi_rsdp {
+	uint8_t		signature[8];	// "RSD PTR "
+	uint8_t		checksum;	// first 20 bytes must add up to 0
+	uint8_t		oemid[6];
+	uint8_t		revision;	// 0 for ACPI 1.0, 2 for 2.0+
+	uint32_t	rsdtaddr;	// phys addr of RSDT
+	// The rest is only in ACPI 2.0 and later (revision >= 2).
+	uint32_t	length;		// length of the whole RSDP
+	uint64_t	xsdtaddr;	// phys addr of XSDT
+	uint8_t		xchecksum;	// all bytes must add up to 0
+	uint8_t		reserved[3];
+} gcc_packed acpi_rsdp;
+
+// Header common to all System Description Tables
+typedef struct acpi_sdt {
+	uint8_t		signature[4];	// "RSDT", "XSDT", "APIC", ...
+	uint32_t	length;		// length of the table, header included
+	uint8_t		revision;
+	uint8_t		checksum;	// all bytes must add up to 0
+	uint8_t		oemid[6];
+	uint8_t		oemtableid[8];
+	uint32_t	oemrevision;
+	uint32_t	creatorid;
+	uint32_t	creatorrevision;
+	uint8_t		data[0];	// table-specific contents
+} gcc_packed acpi_sdt;
+
+// Multiple APIC Description Table ("APIC"), following the header
+typedef struct acpi_madt {
+	uint32_t	lapicaddr;	// phys addr of every local APIC
+	uint32_t	flags;
+		#define MADT_PCAT_COMPAT 0x01	// Also has dual 8259 PICs
+	uint8_t		entries[0];	// variable-length entries
+} gcc_packed acpi_madt;
+
+// MADT entries all start with a type and length byte.
+#define MADT_LAPIC	0	// Processor's local APIC
+#define MADT_IOAPIC	1	// I/O APIC
+#define MADT_ISO	2	// Interrupt source override
+#define MADT_LAPICADDR	5	// 64-bit local APIC address override
+#define MADT_X2APIC	9	// Processor's local x2APIC
+
+typedef struct madt_lapic {
+	uint8_t		type, length;
+	uint8_t		procid;		// ACPI processor ID
+	uint8_t		apicid;		// local APIC ID
+	uint32_t	flags;
+		#define MADT_ENABLED	0x01	// Processor is usable
+} gcc_packed madt_lapic;
+
+typedef struct madt_ioapic {
+	uint8_t		type, length;
+	uint8_t		apicid;		// I/O APIC ID
+	uint8_t		reserved;
+	uint32_t	addr;		// phys addr of the I/O APIC
+	uint32_t	gsibase;	// first global system interrupt it handles
+} gcc_packed madt_ioapic;
+
+typedef struct madt_iso {
+	uint8_t		type, length;
+	uint8_t		bus;		// always 0: ISA
+	uint8_t		irq;		// ISA IRQ number
+	uint32_t	gsi;		// global system interrupt it arrives on
+	uint16_t	flags;		// MPS INTI polarity and trigger flags
+} gcc_packed madt_iso;
+
+typedef struct madt_lapicaddr {
+	uint8_t		type, length;
+	uint16_t	reserved;
+	uint64_t	addr;		// phys addr of every local APIC
+} gcc_packed madt_lapicaddr;
+
+typedef struct madt_x2apic {
+	uint8_t		type, length;
+	uint16_t	reserved;
+	uint32_t	apicid;		// local x2APIC ID
+	uint32_t	flags;		// MADT_ENABLED
+	uint32_t	procuid;	// ACPI processor UID
+} gcc_packed madt_x2apic;
+
+
+// I/O APICs and ISA interrupt overrides found in the MADT
+#define ACPI_MAXIOAPIC	8
+typedef struct acpi_ioapicinfo {
+	uint32_t	apicid;
+	uint32_t	addr;
+	uint32_t	gsibase;
+} acpi_ioapicinfo;
+
+extern int acpi_nioapic;
+extern acpi_ioapicinfo acpi_ioapic[ACPI_MAXIOAPIC];
+
+// Global system interrupt and MPS INTI flags for each ISA IRQ.
+// Without an override, IRQ n arrives on GSI n, edge-triggered, active high.
+extern uint32_t acpi_irqgsi[16];
+extern uint16_t acpi_irqflags[16];
+
+// Number of usable processors the MADT lists, including the boot CPU.
+extern int acpi_ncpu;
+
+
+// Find the processors and interrupt controllers in the system
+// from the ACPI MADT, allocating a cpu struct for each non-boot CPU,
+// and setting the local APIC address.
+// Returns false, having done nothing, if there is no usable MADT.
+bool acpi_init(void);
+
+
+#endif /* !PIOS_KERN_ACPI_H */
@@ -0,0 +1,202 @@
+/*
+ * Page allocator microbenchmarks, run at boot if "bench" is given
+ * on the kernel command line.  Each benchmark runs BENCH_TRIALS times,
+ * and reports cycles per operation over the serial console
+ * as one line per benchmark of the form:
+ *
+ *	bench: name=NAME cpus=N ops=OPS min=CYCLES avg=CYCLES
+ *
+ * where min and avg are the best and mean per-operation cycle counts
+ * over the trials, bracketed by "bench: begin" and "bench: end" lines.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/init.h>
+#include <kern/trap.h>
+#include <kern/bench.h>
+
+
+#define BENCH_TRIALS	5		// Runs of each benchmark
+#define BENCH_OPS	100000		// Operations per run
+#define BENCH_BURST	256		// Pages per alloc/free burst
+#define BENCH_RING	256		// Slots in the cross-CPU page ring
+
+
+// Ring of pages passed from the allocating CPU to the freeing CPU.
+static pageinfo *volatile bench_ring[BENCH_RING];
+static volatile uint32_t bench_head, bench_tail;
+static volatile uint64_t bench_freecyc;	// Freeing CPU's time
+
+
+// Print a summary line from the cycle counts of each trial.
+static void
+bench_report(const char *name, int ncpu, uint32_t ops,
+		uint64_t cyc[BENCH_TRIALS])
+{
+	uint64_t min = cyc[0], sum = 0;
+	int i;
+	for (i = 0; i < BENCH_TRIALS; i++) {
+		min = MIN(min, cyc[i]);
+		sum += cyc[i];
+	}
+	cprintf("bench: name=%s cpus=%d ops=%u min=%u avg=%u\n", name,
+		ncpu, ops, (uint32_t)(min / ops),
+		(uint32_t)(sum / BENCH_TRIALS / ops));
+}
+
+// Allocate and immediately free a single page, repeatedly.
+static uint64_t
+bench_alloc_free(void)
+{
+	int i;
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < BENCH_OPS; i++) {
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		mem_free(pi);
+	}
+	return rdtsc() - t0;
+}
+
+// Allocate a burst of pages, then free them all,
+// timing the allocations and the frees separately.
+static void
+bench_burst(uint64_t *acyc, uint64_t *fcyc)
+{
+	static pageinfo *pis[BENCH_BURST];
+	int r, i;
+	*acyc = *fcyc = 0;
+	for (r = 0; r < BENCH_OPS / BENCH_BURST; r++) {
+		uint64_t t0 = rdtsc();
+		for (i = 0; i < BENCH_BURST; i++) {
+			pis[i] = mem_alloc();
+			assert(pis[i] != NULL);
+		}
+		uint64_t t1 = rdtsc();
+		for (i = 0; i < BENCH_BURST; i++)
+			mem_free(pis[i]);
+		*acyc += t1 - t0;
+		*fcyc += rdtsc() - t1;
+	}
+}
+
+// Take and drop a reference to a page, repeatedly.
+static uint64_t
+bench_ref(pageinfo *pi)
+{
+	int i;
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < BENCH_OPS; i++) {
+		mem_incref(pi);
+		mem_decref(pi, mem_free);
+	}
+	return rdtsc() - t0;
+}
+
+// Allocate pages and pass them to the freeing CPU through the ring.
+static uint64_t
+bench_cross_alloc(void)
+{
+	int i;
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < BENCH_OPS; i++) {
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		while (bench_head - bench_tail == BENCH_RING)
+			pause();
+		bench_ring[bench_head % BENCH_RING] = pi;
+		bench_head++;
+	}
+	return rdtsc() - t0;
+}
+
+// Free the pages the allocating CPU passes us through the ring.
+static uint64_t
+bench_cross_free(void)
+{
+	int i;
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < BENCH_OPS; i++) {
+		while (bench_tail == bench_head)
+			pause();
+		pageinfo *pi = bench_ring[bench_tail % BENCH_RING];
+		bench_tail++;
+		mem_free(pi);
+	}
+	return rdtsc() - t0;
+}
+
+void
+bench_run(void)
+{
+	uint64_t cyc[BENCH_TRIALS], cyc2[BENCH_TRIALS];
+	int ncpu = cpu_count(), t;
+
+	if (!boot_option("bench"))
+		return;
+
+	// Single-CPU benchmarks run on the boot CPU while the others wait.
+	cpu_barrier();
+	if (cpu_onboot()) {
+		cprintf("bench: begin cpus=%d\n", ncpu);
+
+		for (t = 0; t < BENCH_TRIALS; t++)
+			cyc[t] = bench_alloc_free();
+		bench_report("alloc_free", 1, BENCH_OPS, cyc);
+
+		for (t = 0; t < BENCH_TRIALS; t++)
+			bench_burst(&cyc[t], &cyc2[t]);
+		bench_report("burst_alloc", 1,
+			BENCH_OPS / BENCH_BURST * BENCH_BURST, cyc);
+		bench_report("burst_free", 1,
+			BENCH_OPS / BENCH_BURST * BENCH_BURST, cyc2);
+
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		mem_incref(pi);
+		for (t = 0; t < BENCH_TRIALS; t++)
+			cyc[t] = bench_ref(pi);
+		bench_report("ref_incdec", 1, BENCH_OPS, cyc);
+		if (mem_share(pi)) {
+			for (t = 0; t < BENCH_TRIALS; t++)
+				cyc[t] = bench_ref(pi);
+			bench_report("ref_incdec_shared", 1, BENCH_OPS, cyc);
+			mem_unshare(pi, mem_free);
+		}
+		mem_decref(pi, mem_free);
+
+		for (t = 0; t < BENCH_TRIALS; t++)
+			cyc[t] = trap_check_time(BENCH_OPS);
+		bench_report("trap_kernel", 1, BENCH_OPS, cyc);
+	}
+
+	// Cross-CPU frees: the boot CPU allocates, the next CPU frees.
+	for (t = 0; t < BENCH_TRIALS; t++) {
+		cpu_barrier();
+		if (cpu_onboot() && ncpu >= 2)
+			cyc[t] = bench_cross_alloc();
+		else if (cpu_cur() == cpu_boot.next)
+			bench_freecyc = bench_cross_free();
+		cpu_barrier();
+		cyc2[t] = bench_freecyc;
+	}
+	if (cpu_onboot()) {
+		if (ncpu >= 2) {
+			bench_report("cross_alloc", 2, BENCH_OPS, cyc);
+			bench_report("cross_free", 2, BENCH_OPS, cyc2);
+		} else
+			cprintf("bench: name=cross_free skipped=needs-2-cpus\n");
+		cprintf("bench: end\n");
+	}
+}
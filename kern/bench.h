@@ -0,0 +1,22 @@
+/*
+ * Page allocator microbenchmarks.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_BENCH_H
+#define PIOS_KERN_BENCH_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+
+// Run the page allocator benchmarks if "bench" is on the boot command line.
+// Must be called on every CPU, after mem_init().
+void bench_run(void);
+
+
+#endif /* !PIOS_KERN_BENCH_H */
@@ -44,16 +44,49 @@ static struct {
 } cons;
 
 
+// Hotkeys registered with cons_hotkey(), in order of registration.
+#define CONS_MAXHOTKEY	16
+
+static struct {
+	int ch;
+	void (*fn)(void);
+	const char *desc;
+} cons_hotkeys[CONS_MAXHOTKEY];
+static int cons_nhotkey;
+
+void
+cons_hotkey(int ch, void (*fn)(void), const char *desc)
+{
+	int i;
+	for (i = 0; i < cons_nhotkey; i++)
+		if (cons_hotkeys[i].ch == ch)
+			panic("cons_hotkey: ^%c already used for %s",
+				ch + '@', cons_hotkeys[i].desc);
+	assert(cons_nhotkey < CONS_MAXHOTKEY);
+	cons_hotkeys[cons_nhotkey].ch = ch;
+	cons_hotkeys[cons_nhotkey].fn = fn;
+	cons_hotkeys[cons_nhotkey].desc = desc;
+	cons_nhotkey++;
+	cprintf("Press ^%c for %s\n", ch + '@', desc);
+}
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 void
 cons_intr(int (*proc)(void))
 {
-	int c;
+	int c, i;
 
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
+		for (i = 0; i < cons_nhotkey; i++)
+			if (c == cons_hotkeys[i].ch)
+				break;
+		if (i < cons_nhotkey) {
+			cons_hotkeys[i].fn();
+			continue;
+		}
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
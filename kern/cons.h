@@ -29,12 +29,22 @@ struct iocons;
 
 void cons_init(void);
 
+// Return the next input character from the console, or 0 if none waiting.
+// Polls the console devices, so it works with interrupts disabled.
+int cons_getc(void);
+
 // Called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 // Device-specific code supplies 'proc', which polls for a character
 // and returns that character or 0 if no more available from device.
 void cons_intr(int (*proc)(void));
 
+// Register a console hotkey: when the character ch arrives on the console,
+// call fn instead of passing the character on as input.
+// Used to dump kernel statistics on demand.
+#define CONS_HOTKEY(letter)	((letter) & 0x1f)	// Control-letter
+void cons_hotkey(int ch, void (*fn)(void), const char *desc);
+
 // Called by init() when the kernel is ready to receive console interrupts.
 void cons_intenable(void);
 
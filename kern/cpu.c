@@ -14,11 +14,16 @@
 #include <kern/mem.h>
 #include <kern/cpu.h>
 #include <kern/init.h>
+#include <kern/syscall.h>
+
+#include <dev/lapic.h>
 
 
 
 cpu cpu_boot = {
 
+	self: &cpu_boot,
+
 	// Global descriptor table for bootstrap CPU.
 	// The GDTs for other CPUs are copied from this and fixed up.
 	//
@@ -26,7 +31,9 @@ cpu cpu_boot = {
 	// To load the SS register, the CPL must equal the DPL.  Thus,
 	// we must duplicate the segments for the user and the kernel.
 	//
-	// The only descriptor that differs across CPUs is the TSS descriptor.
+	// The only descriptors that differ across CPUs are
+	// the TSS descriptor and the per-CPU data descriptor,
+	// both of which cpu_init() fills in at run time.
 	//
 	gdt: {
 		// 0x0 - unused (always faults: for trapping NULL far pointers)
@@ -39,6 +46,14 @@ cpu cpu_boot = {
 		// 0x10 - kernel data segment
 		[CPU_GDT_KDATA >> 3] = SEGDESC32(1, STA_W, 0x0,
 					0xffffffff, 0),
+
+		// 0x18 - user code segment
+		[CPU_GDT_UCODE >> 3] = SEGDESC32(1, STA_X | STA_R, 0x0,
+					0xffffffff, 3),
+
+		// 0x20 - user data segment
+		[CPU_GDT_UDATA >> 3] = SEGDESC32(1, STA_W, 0x0,
+					0xffffffff, 3),
 	},
 
 	magic: CPU_MAGIC
@@ -47,7 +62,21 @@ cpu cpu_boot = {
 
 void cpu_init()
 {
-	cpu *c = cpu_cur();
+	// %gs isn't set up yet, so find our cpu struct the slow way.
+	cpu *c = cpu_stack();
+	c->self = c;
+
+	// Set up the TSS so traps from user mode land on our kernel stack,
+	// and the per-CPU data segment covering our cpu struct.
+	// Segment base addresses get split into pieces in the descriptor,
+	// which relocation records can't express, so we do this at run time.
+	c->tss.ts_esp0 = (uint32_t) c->kstackhi;
+	c->tss.ts_ss0 = CPU_GDT_KDATA;
+	c->tss.ts_iomb = sizeof(taskstate);	// no I/O permission bitmap
+	c->gdt[CPU_GDT_TSS >> 3] = SEGDESC16(0, STS_T32A, (uint32_t) &c->tss,
+					sizeof(taskstate) - 1, 0);
+	c->gdt[CPU_GDT_KCPU >> 3] = SEGDESC16(1, STA_W, (uint32_t) c,
+					sizeof(cpu) - 1, 0);
 
 	// Load the GDT
 	struct pseudodesc gdt_pd = {
@@ -55,15 +84,164 @@ void cpu_init()
 	asm volatile("lgdt %0" : : "m" (gdt_pd));
 
 	// Reload all segment registers.
-	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_UDATA|3));
+	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_KCPU));
 	asm volatile("movw %%ax,%%fs" :: "a" (CPU_GDT_UDATA|3));
 	asm volatile("movw %%ax,%%es" :: "a" (CPU_GDT_KDATA));
 	asm volatile("movw %%ax,%%ds" :: "a" (CPU_GDT_KDATA));
 	asm volatile("movw %%ax,%%ss" :: "a" (CPU_GDT_KDATA));
 	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (CPU_GDT_KCODE)); // reload CS
 
+	// Load the TSS.
+	ltr(CPU_GDT_TSS);
+
 	// We don't need an LDT.
 	asm volatile("lldt %%ax" :: "a" (0));
+
+	// Set up the fast system call entry point.
+	syscall_init();
+
+	assert(cpu_cur() == c);
+}
+
+cpu *
+cpu_alloc(void)
+{
+	// Pointer to where the next cpu struct should be linked.
+	static cpu **cpu_tail = &cpu_boot.next;
+	static uint32_t cpu_nextid = 1;
+
+	assert(cpu_nextid < CPU_MAX);
+	pageinfo *pi = mem_alloc();
+	assert(pi != 0);	// shouldn't be out of memory just yet!
+	mem_incref(pi);
+
+	cpu *c = (cpu*) mem_pi2ptr(pi);
+	memset(c, 0, sizeof(cpu));
+	c->self = c;
+	c->id = cpu_nextid++;
+
+	// Use a copy of the boot CPU's GDT; cpu_init() fills in the rest.
+	memmove(c->gdt, cpu_boot.gdt, sizeof(c->gdt));
+
+	// Give the new CPU its own zeroed copy of the percpu section,
+	// in whole pages of its own.
+	uint32_t size = __stop_percpu - __start_percpu;
+	if (size > 0) {
+		int order = 0;
+		while ((PAGESIZE << order) < size)
+			order++;
+		pageinfo *ppi = mem_alloc_order(order);
+		assert(ppi != NULL);
+		mem_incref(ppi);
+		memset(mem_pi2ptr(ppi), 0, PAGESIZE << order);
+		c->percpu_off = (char*) mem_pi2ptr(ppi) - __start_percpu;
+	}
+
+	c->magic = CPU_MAGIC;
+
+	*cpu_tail = c;
+	cpu_tail = &c->next;
+
+	return c;
 }
 
+// Set once cpu_bootothers() has settled the final list of running CPUs.
+static volatile uint32_t cpu_bootdone;
 
+void
+cpu_bootothers(void)
+{
+	extern uint8_t _binary_obj_boot_bootother_start[],
+			_binary_obj_boot_bootother_size[];
+	static cpu *apcpu[CPU_MAX];	// cpu structs for APs to claim
+
+	cpu *c = cpu_cur();
+	c->apicid = lapic_id();
+	if (!cpu_onboot()) {
+		// Tell the boot CPU we're up, then wait until it knows
+		// which CPUs made it, so that we never count CPUs it drops.
+		xchg(&c->booted, 1);
+		while (!cpu_bootdone)
+			pause();
+		return;
+	}
+	c->booted = 1;
+	if (cpu_boot.next == NULL)
+		return;		// no other CPUs found
+
+	// Write bootstrap code to unused memory at 0x1000,
+	// and below it the words bootother.S needs (see there).
+	uint8_t *code = mem_ptr(0x1000);
+	memmove(code, _binary_obj_boot_bootother_start,
+		(uint32_t) _binary_obj_boot_bootother_size);
+	int n = 0;
+	for (c = cpu_boot.next; c != NULL; c = c->next)
+		apcpu[n++] = c;
+	uint32_t *args = (uint32_t*) code;
+	volatile uint32_t *next = &args[-4];
+	args[-1] = (uint32_t) init;
+	args[-2] = (uint32_t) apcpu;
+	args[-3] = n;
+	*next = 0;
+
+	// Start them all, then wait for each to finish its per-CPU setup.
+	uint64_t t0 = lapic_startcpus(mem_phys(code));
+	uint64_t deadline = t0 + (uint64_t) CPU_BOOTWAIT_MS * lapic_tsckhz;
+	int up;
+	while (1) {
+		for (up = 0; up < n && apcpu[up]->booted; up++)
+			;
+		if (up == n)
+			break;
+
+		// If CPUs we found haven't even claimed a cpu struct
+		// by the deadline, they aren't coming: drop their structs,
+		// leaving any latecomers to halt in bootother.S.
+		// Those that claimed one in time get to finish.
+		if (rdtsc() > deadline && *next < n) {
+			uint32_t claimed = xchg(next, n);
+			if (claimed < n) {
+				warn("cpu_bootothers: %d of %d CPUs "
+					"failed to start", n - claimed, n);
+				n = claimed;
+				if (n > 0)
+					apcpu[n-1]->next = NULL;
+				else
+					cpu_boot.next = NULL;
+			}
+		}
+		pause();
+	}
+	uint64_t cyc = rdtsc() - t0;
+	xchg(&cpu_bootdone, 1);	// release the APs into the rest of init()
+
+	cprintf("cpu_bootothers: %d CPUs up %llu cycles (%u us) "
+		"after first SIPI\n", n + 1, cyc,
+		(uint32_t) (cyc * 1000 / lapic_tsckhz));
+}
+
+int
+cpu_count(void)
+{
+	int n = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		n++;
+	return n;
+}
+
+// Every CPU passes the same barriers in the same order,
+// so one ever-growing arrival counter serves them all:
+// the b'th barrier is complete once b times cpu_count() CPUs have arrived.
+static volatile uint32_t cpu_arrived;
+static PERCPU_DEFINE(uint32_t, cpu_nbarrier);	// Barriers this CPU passed
+
+void
+cpu_barrier(void)
+{
+	uint32_t b = ++percpu(cpu_nbarrier);
+	uint32_t n = cpu_count();
+	xadd(&cpu_arrived, 1);
+	while (cpu_arrived < b * n)
+		pause();
+}
@@ -21,7 +21,8 @@
 #define CPU_GDT_UDATA	0x20	// user data
 #define CPU_GDT_UDTLS	0x28	// user thread local storage data segment
 #define CPU_GDT_TSS	0x30	// task state segment
-#define CPU_GDT_NDESC	7	// number of GDT entries used, including null
+#define CPU_GDT_KCPU	0x38	// kernel per-CPU data: this CPU's cpu struct
+#define CPU_GDT_NDESC	8	// number of GDT entries used, including null
 
 
 #ifndef __ASSEMBLER__
@@ -33,9 +34,37 @@
 #include <inc/trap.h>
 
 
+// Maximum number of CPUs the kernel supports.
+// Per-CPU variables (see PERCPU_DEFINE below) cost nothing for CPUs
+// that aren't there; only cpu_bootothers()'s table of pointers does.
+#define CPU_MAX		64
+
+
 // Per-CPU kernel state structure.
 // Exactly one page (4096 bytes) in size.
 typedef struct cpu {
+	// Pointer to this cpu struct itself.  Must be first:
+	// the CPU_GDT_KCPU segment starts at the cpu struct,
+	// so cpu_cur() can fetch this pointer with a single load from %gs:0.
+	struct cpu	*self;
+
+	// Next in the list of all CPUs, headed by cpu_boot (see below).
+	struct cpu	*next;
+
+	// Small integer identifying this CPU; the boot CPU is always 0.
+	uint32_t	id;
+
+	// This CPU's local APIC ID, which other CPUs use to send it IPIs.
+	uint32_t	apicid;
+
+	// Set once this CPU has finished its per-CPU initialization,
+	// to let cpu_bootothers() know it's up.
+	volatile uint32_t booted;
+
+	// Offset from each per-CPU variable to this CPU's copy of it:
+	// zero on the boot CPU, which uses the percpu section itself.
+	intptr_t	percpu_off;
+
 	// Since the x86 processor finds the TSS from a descriptor in the GDT,
 	// each processor needs its own TSS segment descriptor in some GDT.
 	// We could have a single, "global" GDT with multiple TSS descriptors,
@@ -52,6 +81,20 @@ typedef struct cpu {
 	gcc_noreturn void (*recover)(trapframe *tf, void *recoverdata);
 	void		*recoverdata;
 
+	// Per-CPU cache ("magazine") of free physical pages,
+	// chained through their pageinfo free_next links.
+	// mem_alloc() and mem_free() touch only this list in the common case,
+	// and exchange pages with the global free list in batches.
+	struct pageinfo	*mem_mag;
+	int		mem_magcount;
+
+	// Next page color mem_alloc_color() hands out round-robin.
+	int		mem_color;
+
+	// Nonzero while this CPU is updating a shared page's refcount delta;
+	// see mem_shared_add() in kern/mem.c.
+	volatile uint32_t mem_refbusy;
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
@@ -72,15 +115,53 @@ extern cpu cpu_boot;
 
 #define cpu_disabled(c)		0
 
-// Find the CPU struct representing the current CPU.
+// Find the CPU struct from the current kernel stack pointer.
 // It always resides at the bottom of the page containing the CPU's stack.
+// Used only where %gs may not be set up yet: see cpu_init() and trap().
 static inline cpu *
-cpu_cur() {
+cpu_stack() {
 	cpu *c = (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
 	assert(c->magic == CPU_MAGIC);
 	return c;
 }
 
+// Find the CPU struct representing the current CPU,
+// via the per-CPU data segment cpu_init() loads into %gs.
+// Define CPU_DEBUG to also cross-check it against the stack pointer
+// on every call, as cpu_cur() always used to.
+static inline cpu *
+cpu_cur() {
+	cpu *c;
+	asm volatile("movl %%gs:0,%0" : "=r" (c));
+#ifdef CPU_DEBUG
+	assert(c == cpu_stack() && c->self == c);
+#endif
+	return c;
+}
+
+
+// Per-CPU variables live in the "percpu" linker section.
+// The boot CPU uses the section as linked, and cpu_alloc() gives each
+// other CPU its own page-aligned copy, so CPUs never share cache lines
+// through their per-CPU variables.
+// Every CPU's copy starts out zero, like the BSS:
+// per-CPU variables can't have initializers.
+//
+// Define a per-CPU variable with PERCPU_DEFINE(type, name) in a .c file
+// and declare it elsewhere with PERCPU_DECLARE(type, name);
+// then use percpu(name) for the current CPU's copy,
+// or percpu_on(c, name) for CPU c's copy.
+#define PERCPU_DEFINE(type, name)	\
+	type name __attribute__((section("percpu")))
+#define PERCPU_DECLARE(type, name)	\
+	extern type name
+#define percpu_on(c, var)		\
+	(*(__typeof__(&(var))) ((void*) &(var) + (c)->percpu_off))
+#define percpu(var)	percpu_on(cpu_cur(), var)
+
+// Bounds of the percpu section, provided by the linker.
+extern char __start_percpu[], __stop_percpu[];
+
 // Returns true if we're running on the bootstrap CPU.
 static inline int
 cpu_onboot() {
@@ -88,18 +169,36 @@ cpu_onboot() {
 }
 
 
-// Set up the current CPU's private register state such as GDT and TSS.
+// Set up the current CPU's private register state such as GDT and TSS,
+// and point %gs at its cpu struct so cpu_cur() works.
+// Must come before anything else that calls cpu_cur().
 // Assumes the cpu struct for this CPU is basically initialized
 // and that we're running on the cpu's correct kernel stack.
 void cpu_init(void);
 
 // Allocate an additional cpu struct representing a non-bootstrap processor,
+// along with its copy of the per-CPU variables,
 // and chain it onto the list of all CPUs.
 cpu *cpu_alloc(void);
 
 // Get any additional processors booted up and running.
+// On the boot CPU, starts all other CPUs at once
+// and waits for them all to get this far in init();
+// on other CPUs, reports that this CPU is up and waits for the boot CPU
+// to settle the final list of CPUs, dropping any that failed to start.
 void cpu_bootothers(void);
 
+// How long cpu_bootothers() waits for all CPUs to start,
+// before giving up on any that haven't.
+#define CPU_BOOTWAIT_MS	1000
+
+// Return the number of CPUs running the kernel, including the boot CPU.
+int cpu_count(void);
+
+// Wait until every running CPU has called cpu_barrier() as many times
+// as this one has.  All CPUs must pass the same sequence of barriers.
+void cpu_barrier(void);
+
 #endif	// ! __ASSEMBLER__
 
 #endif // PIOS_KERN_CPU_H
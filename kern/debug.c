@@ -68,10 +68,20 @@ debug_warn(const char *file, int line, const char *fmt,...)
 }
 
 // Record the current call stack in eips[] by following the %ebp chain.
+// Each frame holds the caller's %ebp at 0(%ebp) and our return EIP
+// at 4(%ebp); entry.S and bootother.S start the chain with a zero %ebp.
+// Unused entries of eips[] are set to zero.
 void gcc_noinline
 debug_trace(uint32_t ebp, uint32_t eips[DEBUG_TRACEFRAMES])
 {
-	panic("debug_trace not implemented");
+	int i;
+	for (i = 0; i < DEBUG_TRACEFRAMES && ebp != 0; i++) {
+		uint32_t *frame = (uint32_t *) ebp;
+		eips[i] = frame[1];
+		ebp = frame[0];
+	}
+	for (; i < DEBUG_TRACEFRAMES; i++)
+		eips[i] = 0;
 }
 
 
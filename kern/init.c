@@ -12,13 +12,25 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/cdefs.h>
+#include <inc/x86.h>
+#include <inc/syscall.h>
 
 #include <kern/init.h>
 #include <kern/cons.h>
 #include <kern/debug.h>
 #include <kern/mem.h>
+#include <kern/slab.h>
+#include <kern/pmap.h>
+#include <kern/merge.h>
+#include <kern/bench.h>
 #include <kern/cpu.h>
 #include <kern/trap.h>
+#include <kern/mp.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/prof.h>
+
+#include <dev/lapic.h>
 
 
 
@@ -41,33 +53,116 @@ init(void)
 {
 	extern char start[], edata[], end[];
 
-	// Before anything else, complete the ELF loading process.
+	// Before anything else, point %gs at this CPU's cpu struct,
+	// so that cpu_cur() and cpu_onboot() work.
+	// This loads the GDT and TSS too, but touches nothing in the BSS.
+	cpu_init();
+
+	// Then complete the ELF loading process.
 	// Clear all uninitialized global data (BSS) in our program,
 	// ensuring that all static/global variables start out zero.
 	if (cpu_onboot())
 		memset(edata, 0, end - edata);
+	uint64_t tsc = rdtsc();
 
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
 
-	// Lab 1: test cprintf and debug_trace
-	cprintf("1234 decimal is %o octal!\n", 1234);
-	debug_check();
+	// Lab 1: test cprintf and debug_trace.
+	// Only on the boot CPU: all the others get here at once,
+	// and their output would interleave on the unlocked console.
+	if (cpu_onboot()) {
+		cprintf("1234 decimal is %o octal!\n", 1234);
+		debug_check();
+	}
 
-	// Initialize and load the bootstrap CPU's GDT, TSS, and IDT.
-	cpu_init();
+	// Initialize and load the IDT.
 	trap_init();
 
 	// Physical memory detection/initialization.
 	// Can't call mem_alloc until after we do this!
 	mem_init();
 
+	// Map physical memory with 4MB pages and turn on paging.
+	pmap_init();
+
+	// Find and start other processors in a multiprocessor system.
+	mp_init();		// Find info about processors in system
+	lapic_init();		// Set up this CPU's local APIC
+	prof_init();		// Set up timer-driven profiling
+	cpu_bootothers();	// Get other processors started
+
+	// Sample where all CPUs spend their time from here on,
+	// if "prof" is on the boot command line.
+	prof_start();
+
+	// Check and time our spinlocks with all CPUs contending.
+	spinlock_check();
+
+	// Measure page allocator scalability across all running CPUs.
+	mem_check_mp();
+
+	// Set up the slab allocator for small kernel objects.
+	slab_init();
+
+	// Set up background merging of identical pages.
+	merge_init();
+
+	// Run the allocator benchmarks if asked to on the command line.
+	bench_run();
+
+	// Stop profiling, and dump the samples from the boot CPU.
+	prof_stop();
+
+	// Only the boot CPU goes on to run user();
+	// the others finish initializing physical memory in the background,
+	// then zero free pages in advance and merge duplicate pages
+	// while they're idle.
+	if (!cpu_onboot())
+		while (1)
+			if (!mem_init_more() && !mem_zero_idle()
+					&& !merge_idle())
+				pause();
+
+	cprintf("Boot took %lld cycles\n", rdtsc() - tsc);
+
+	// Enter user() in user mode, running on the user_stack declared above.
+	// User code may not use %gs to reach kernel per-CPU data,
+	// so give it the flat user data segment there like everywhere else.
+	// IOPL 3 lets user() still drive the console for now.
+	trapframe tf = {
+		gs: CPU_GDT_UDATA | 3,
+		fs: CPU_GDT_UDATA | 3,
+		es: CPU_GDT_UDATA | 3,
+		ds: CPU_GDT_UDATA | 3,
+		eip: (uint32_t) user,
+		cs: CPU_GDT_UCODE | 3,
+		eflags: FL_IOPL_3,
+		esp: (uint32_t) &user_stack[PAGESIZE],
+		ss: CPU_GDT_UDATA | 3,
+	};
+	trap_return(&tf);
+}
+
+char boot_cmdline[BOOT_CMDLINEMAX];
 
-	// Lab 1: change this so it enters user() in user mode,
-	// running on the user_stack declared above,
-	// instead of just calling user() directly.
-	user();
+bool
+boot_option(const char *name)
+{
+	const char *s = boot_cmdline;
+	int len = strlen(name);
+	while (*s) {
+		while (*s == ' ')
+			s++;
+		const char *e = s;
+		while (*e && *e != ' ')
+			e++;
+		if (e - s == len && strncmp(s, name, len) == 0)
+			return true;
+		s = e;
+	}
+	return false;
 }
 
 // This is the first function that gets run in user mode (ring 3).
@@ -83,6 +178,9 @@ user()
 	// Check that we're in user mode and can handle traps from there.
 	trap_check_user();
 
+	// Check and time both ways of making system calls.
+	syscall_check();
+
 	done();
 }
 
@@ -93,7 +191,17 @@ user()
 void gcc_noreturn
 done()
 {
-	while (1)
-		;	// just spin
+	// Just spin, but still respond to hotkeys.
+	// Their handlers use %gs to find per-CPU data, which only works
+	// in the kernel, so from user mode poll the console by system call.
+	if ((read_cs() & 3) == 0)
+		while (1)
+			cons_getc();
+	else if (syscall_hasfast())
+		while (1)
+			syscall_sysenter(SYS_CGETC, 0, 0, 0);
+	else
+		while (1)
+			syscall_int(SYS_CGETC, 0, 0, 0);
 }
 
@@ -15,8 +15,23 @@
 #endif
 
 #include <inc/cdefs.h>
+#include <inc/multiboot.h>
 
 
+// Boot information passed in from the boot loader, saved by entry.S.
+// Valid only if boot_mbmagic == MULTIBOOT_BOOTLOADER_MAGIC,
+// and only until mem_init() frees the memory it lives in.
+extern uint32_t boot_mbmagic;
+extern multiboot_info *boot_mbinfo;
+
+// Copy of the boot command line, saved by mem_init() for boot_option().
+#define BOOT_CMDLINEMAX	256
+extern char boot_cmdline[BOOT_CMDLINEMAX];
+
+// Returns true if the word 'name' appears on the boot command line.
+// Only meaningful after mem_init().
+bool boot_option(const char *name);
+
 // Called on each processor to initialize the kernel.
 void init(void);
 
@@ -15,6 +15,9 @@
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
+#include <kern/spinlock.h>
+#include <kern/init.h>
+#include <kern/cons.h>
 
 #include <dev/nvram.h>
 
@@ -23,11 +26,170 @@ size_t mem_max;			// Maximum physical address
 size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
+int mem_ncolor = 1;		// Number of page colors
 
-pageinfo *mem_freelist;		// Start of free page list
+// Free physical memory not cached in any CPU's magazine is kept in
+// binary buddy free lists: mem_freelist[k] chains free blocks of 2^k pages,
+// each aligned to 2^k pages and headed by the pageinfo of its first page.
+pageinfo *mem_freelist[MEM_MAXORDER+1];	// Buddy free lists, by order
+size_t mem_nfree;			// Total pages on the buddy lists
+mcslock mem_freelock;			// Protects all of the above
+
+// Single pages drained from CPU magazines go first onto a global
+// lock-free stack (a Treiber stack), so that magazines can usually refill
+// and drain without touching the buddy lists or taking mem_freelock.
+// The stack word holds the link to the top page in its low half,
+// and in its high half a tag that changes on every update,
+// so that a compare-and-swap can't succeed on a top link that was
+// popped and pushed back in between (the ABA problem).
+// Pages on the stack don't coalesce until they are flushed to the buddy
+// lists, which happens only when a contiguous allocation can't be satisfied.
+typedef uint64_t memstack;
+#define MEMSTACK_LINK(st)	((uint32_t) (st))
+#define MEMSTACK_TAG(st)	((uint32_t) ((st) >> 32))
+#define MEMSTACK(link, tag)	(((uint64_t) (tag) << 32) | (link))
+
+volatile memstack gcc_aligned(8) mem_pagestack;	// Global free page stack
+
+// Idle CPUs zero free pages ahead of time and keep them on a second
+// lock-free stack, so that mem_alloc_zeroed() usually needn't clear a page.
+#define MEM_ZEROMAX	256		// Most pre-zeroed pages to keep on hand
+
+volatile memstack gcc_aligned(8) mem_zerostack;	// Pre-zeroed free pages
+static volatile uint32_t mem_nzero;	// Roughly how many on mem_zerostack
+static bool mem_nontemporal;		// Can zero pages with MOVNTI?
+
+// Pre-zeroed page pool statistics, updated atomically.
+static int32_t mem_zero_hits;		// mem_alloc_zeroed() found one ready
+static int32_t mem_zero_misses;		// mem_alloc_zeroed() had to zero it
+static int32_t mem_zero_idled;		// Pages zeroed by idle CPUs
+
+// Buddy allocator statistics, updated atomically.
+static int32_t mem_nalloc_order[MEM_MAXORDER+1];	// Successful allocations
+static int32_t mem_nfail_order[MEM_MAXORDER+1];	// Failed allocations
+
+// Free pages sorted by color for mem_alloc_color(), protected by mem_freelock.
+// Refilling takes a whole buddy block of mem_ncolor pages when it can,
+// which being naturally aligned holds exactly one page of every color.
+#define MEM_COLORMAX	8		// Most pages kept on each color list
+#define MEM_COLORTRIES	16		// Most blocks to split per allocation
+static pageinfo *mem_colorlist[MEM_MAXCOLOR];	// Free pages by color
+static int mem_colorcount[MEM_MAXCOLOR];	// Pages on each color list
+static int mem_colorways = 1;		// Associativity of colored cache
+
+// Scalable reference counts for widely shared pages.
+// While a page is PI_SHARED, each CPU accumulates its net change
+// to the page's reference count in its own copy of mem_refdelta,
+// at index pi->slot, and pi->refcount holds one extra "bias" reference
+// so that it can't reach zero until mem_unshare() folds the deltas back in.
+typedef struct mem_refrow {
+	volatile int32_t delta[MEM_SHAREMAX];
+} gcc_aligned(64) mem_refrow;
+static PERCPU_DEFINE(mem_refrow, mem_refdelta);
+static pageinfo *mem_sharedpage[MEM_SHAREMAX];	// Page using each slot
+static spinlock mem_sharelock;			// Protects mem_sharedpage
+
+// Temporary bias mem_unshare() holds while folding deltas back in;
+// larger than any count of references direct decrements could drop.
+#define MEM_UNSHAREBIAS	0x40000000
+
+// Per-CPU allocator statistics.
+PERCPU_DEFINE(mem_cpustats, mem_stats);
+static uint32_t mem_ninit;		// Pages freed by mem_init_chunk()
+
+
+// Each CPU keeps up to MEM_MAGMAX free pages in its own magazine,
+// and refills or drains it MEM_MAGBATCH pages at a time,
+// so that only about one in MEM_MAGBATCH calls to mem_alloc() or mem_free()
+// needs to touch the shared buddy lists and their lock.
+#define MEM_MAGBATCH	16
+#define MEM_MAGMAX	(MEM_MAGBATCH*2)
+
+
+// Physical memory is initialized in chunks of MEM_CHUNK pages:
+// 4MB, the size of the largest buddy block, so that each chunk's pages
+// coalesce among themselves without looking at any other chunk's pageinfo.
+// mem_init() initializes only the chunks below MEM_EARLY right away,
+// which is plenty to finish booting; the rest are initialized
+// by other CPUs once they're up, or on demand when memory runs short.
+#define MEM_CHUNK	(1 << MEM_MAXORDER)
+#define MEM_EARLY	(128*1024*1024)
+
+// The boot memory map, saved for initializing chunks after boot,
+// by which time the boot loader's copy may have been reused.
+#define MEM_MAPMAX	64
+static struct memregion {
+	uint32_t	lo, hi;		// Page-aligned physical address range
+	bool		avail;		// Usable RAM, or reserved?
+} mem_map[MEM_MAPMAX];
+static int mem_nmap;
+
+static uint32_t mem_kernlo, mem_kernhi;	// Kernel and pageinfo array
+static uint32_t mem_nchunk;		// Total chunks of physical memory
+static volatile uint32_t mem_nextchunk;	// Next chunk to initialize
 
 
 void mem_check(void);
+static void mem_color_init(void);
+static void mem_color_check(void);
+
+// Free function for mem_check() that notes which page it freed.
+static pageinfo *mem_check_freed;
+static void
+mem_check_free(pageinfo *pi)
+{
+	mem_check_freed = pi;
+	mem_free(pi);
+}
+static void mem_buddy_put(pageinfo *pi, int order);
+static void mem_init_chunk(uint32_t chunk);
+
+// Add a region to the saved memory map,
+// clipping it to the page-aligned part of it that we can reach
+// with 32-bit physical addresses (rounding outward for reserved regions).
+static void
+mem_map_add(uint64_t base, uint64_t length, bool avail)
+{
+	uint64_t top = MIN(base + length, (uint64_t)0xfffff000);
+	if (avail) {
+		base = (base + PAGESIZE-1) & ~(uint64_t)(PAGESIZE-1);
+		top &= ~(uint64_t)(PAGESIZE-1);
+	} else {
+		base &= ~(uint64_t)(PAGESIZE-1);
+		top = (top + PAGESIZE-1) & ~(uint64_t)(PAGESIZE-1);
+	}
+	if (base >= top)
+		return;
+	if (mem_nmap == MEM_MAPMAX)
+		panic("mem_map_add: too many memory map regions");
+	mem_map[mem_nmap].lo = base;
+	mem_map[mem_nmap].hi = top;
+	mem_map[mem_nmap].avail = avail;
+	mem_nmap++;
+}
+
+bool
+mem_isram(uint32_t lo, uint32_t hi)
+{
+	// As in mem_init_chunk(), reserved regions override available ones.
+	int r;
+	for (r = 0; r < mem_nmap; r++)
+		if (!mem_map[r].avail && mem_map[r].lo < hi
+				&& mem_map[r].hi > lo)
+			return false;
+
+	// The available regions must cover the whole range between them.
+	while (lo < hi) {
+		for (r = 0; r < mem_nmap; r++)
+			if (mem_map[r].avail && mem_map[r].lo <= lo
+					&& mem_map[r].hi > lo)
+				break;
+		if (r == mem_nmap)
+			return false;
+		lo = mem_map[r].hi;
+	}
+	return true;
+}
 
 void
 mem_init(void)
@@ -35,20 +197,55 @@ mem_init(void)
 	if (!cpu_onboot())	// only do once, on the boot CPU
 		return;
 
-	// Determine how much base (<640K) and extended (>1MB) memory
-	// is available in the system (in bytes),
-	// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
-	// The NVRAM tells us how many kilobytes there are.
-	// Since the count is 16 bits, this gives us up to 64MB of RAM;
-	// additional RAM beyond that would have to be detected another way.
-	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
-	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+	// Save the boot command line before we free the memory it's in.
+	if (boot_mbmagic == MULTIBOOT_BOOTLOADER_MAGIC
+			&& (boot_mbinfo->flags & MULTIBOOT_INFO_CMDLINE))
+		strlcpy(boot_cmdline, mem_ptr(boot_mbinfo->cmdline),
+			sizeof(boot_cmdline));
+
+	// Save the physical memory map the boot loader passed us:
+	// either from a Multiboot loader such as GRUB,
+	// or the BIOS's E820 map as collected by boot/boot.S.
+	if (boot_mbmagic == MULTIBOOT_BOOTLOADER_MAGIC
+			&& (boot_mbinfo->flags & MULTIBOOT_INFO_MMAP)) {
+		multiboot_mmap *m = mem_ptr(boot_mbinfo->mmap_addr);
+		multiboot_mmap *mend = mem_ptr(boot_mbinfo->mmap_addr
+						+ boot_mbinfo->mmap_length);
+		for (; m < mend; m = (void *) m + m->size + 4)
+			mem_map_add(m->base, m->length,
+				m->type == MULTIBOOT_MEMORY_AVAILABLE);
+	}
 
-	warn("Assuming we have 1GB of memory!");
-	extmem = 1024*1024*1024 - MEM_EXT;	// assume 1GB total memory
+	// Determine how much base (<640K) and extended (>1MB) memory
+	// is available in the system (in bytes).
+	// The maximum physical address is the top of the highest
+	// available region we can address with 32-bit physical addresses.
+	size_t basemem = 0, extmem = 0;
+	int i;
+	mem_max = 0;
+	for (i = 0; i < mem_nmap; i++) {
+		uint32_t lo = mem_map[i].lo, hi = mem_map[i].hi;
+		if (!mem_map[i].avail)
+			continue;
+		if (lo < MEM_IO)
+			basemem += MIN(hi, MEM_IO) - lo;
+		if (hi > MEM_EXT)
+			extmem += hi - MAX(lo, MEM_EXT);
+		mem_max = MAX(mem_max, hi);
+	}
 
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+	// Without a memory map, fall back on the PC's BIOS-managed
+	// nonvolatile RAM (NVRAM), which tells us how many kilobytes there are.
+	// Since the count is 16 bits, this gives us up to 64MB of RAM.
+	if (mem_max == 0) {
+		warn("No boot memory map; trusting NVRAM for memory size");
+		basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
+		extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+		mem_max = MEM_EXT + extmem;
+		mem_nmap = 0;
+		mem_map_add(0, basemem, true);
+		mem_map_add(MEM_EXT, extmem, true);
+	}
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
@@ -58,44 +255,311 @@ mem_init(void)
 		(int)(basemem/1024), (int)(extmem/1024));
 
 
-	// Insert code here to:
-	// (1)	allocate physical memory for the mem_pageinfo array,
-	//	making it big enough to hold mem_npage entries.
-	// (2)	add all pageinfo structs in the array representing
-	//	available memory that is not in use for other purposes.
-	//
-	// For step (2), here is some incomplete/incorrect example code
-	// that simply marks all mem_npage pages as free.
-	// Which memory is actually free?
-	//  1) Reserve page 0 for the real-mode IDT and BIOS structures
-	//     (do not allow this page to be used for anything else).
-	//  2) Reserve page 1 for the AP bootstrap code (boot/bootother.S).
-	//  3) Mark the rest of base memory as free.
-	//  4) Then comes the IO hole [MEM_IO, MEM_EXT).
-	//     Mark it as in-use so that it can never be allocated.      
-	//  5) Then extended memory [MEM_EXT, ...).
-	//     Some of it is in use, some is free.
-	//     Which pages hold the kernel and the pageinfo array?
-	//     Hint: the linker places the kernel (see start and end above),
-	//     but YOU decide where to place the pageinfo array.
-	// Change the code to reflect this.
-	pageinfo **freetail = &mem_freelist;
-	int i;
-	for (i = 0; i < mem_npage; i++) {
+	// Place the pageinfo array in the first pages following the kernel.
+	// Every page starts out reserved, and we free only pages
+	// lying entirely within available memory,
+	// so holes in the memory map can never be allocated.
+	mcslock_init(&mem_freelock);
+	spinlock_init(&mem_sharelock);
+	mem_pageinfo = mem_ptr(ROUNDUP(mem_phys(end), PAGESIZE));
+	size_t pisize = ROUNDUP(mem_npage * sizeof(pageinfo), PAGESIZE);
+	static_assert(sizeof(pageinfo) == 12);
+	cprintf("Page metadata: %dK, %d bytes per page\n",
+		(int)(pisize/1024), (int)sizeof(pageinfo));
+	mem_kernlo = ROUNDDOWN(mem_phys(start), PAGESIZE);
+	mem_kernhi = mem_phys(mem_pageinfo) + pisize;
+
+	// Zero pages with non-temporal stores if the processor supports them.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	mem_nontemporal = (inf.edx & CPUID_EDX_SSE2) != 0;
+
+	// Find out how many page colors our caches have.
+	mem_color_init();
+
+	// Initialize just the low chunks of memory for now.
+	uint32_t nchunk = ROUNDUP(mem_npage, MEM_CHUNK) / MEM_CHUNK;
+	uint32_t early = MIN(MEM_EARLY / PAGESIZE / MEM_CHUNK, nchunk);
+	for (i = 0; i < early; i++)
+		mem_init_chunk(i);
+	mem_nextchunk = mem_nchunk = early;
+
+	cons_hotkey(CONS_HOTKEY('P'), mem_stats_print,
+			"page allocator statistics");
+
+	// Check to make sure the page allocator seems to work correctly.
+	// mem_check() exhausts free memory on purpose, so don't let
+	// mem_init_more() hand out the rest until it's done.
+	mem_check();
+	mem_nchunk = nchunk;
+}
+
+// Initialize the pageinfo structs for one chunk of physical memory,
+// and free the chunk's usable pages.
+static void
+mem_init_chunk(uint32_t chunk)
+{
+	uint32_t lo = chunk * MEM_CHUNK;
+	uint32_t hi = MIN(lo + MEM_CHUNK, mem_npage);
+	uint32_t palo = lo * PAGESIZE, pahi = hi * PAGESIZE;
+	uint32_t i, pa;
+	memset(&mem_pageinfo[lo], 0, (hi - lo) * sizeof(pageinfo));
+
+	// Mark the usable pages according to the memory map.
+	// Some BIOSes report overlapping regions, so apply all the
+	// available regions first, then knock out anything reserved.
+	int pass, r;
+	for (pass = 0; pass < 2; pass++)
+		for (r = 0; r < mem_nmap; r++) {
+			if (mem_map[r].avail != (pass == 0))
+				continue;
+			uint32_t rlo = MAX(mem_map[r].lo, palo);
+			uint32_t rhi = MIN(mem_map[r].hi, pahi);
+			for (pa = rlo; pa < rhi; pa += PAGESIZE)
+				if (pass == 0)
+					mem_phys2pi(pa)->flags |= PI_AVAIL;
+				else
+					mem_phys2pi(pa)->flags &= ~PI_AVAIL;
+		}
+
+	// Free the usable pages in ascending order,
+	// letting the buddy allocator coalesce them into large blocks.
+	// Some usable pages must still never be allocated:
+	//  1) page 0 holds the real-mode IDT and BIOS structures;
+	//  2) page 1 is reserved for the AP bootstrap code (boot/bootother.S);
+	//  3) the I/O hole [MEM_IO, MEM_EXT) can never be allocated;
+	//  4) [mem_kernlo,mem_kernhi) holds the kernel itself
+	//     and the pageinfo array we place right after it.
+	mcslock_acquire(&mem_freelock);
+	for (i = lo; i < hi; i++) {
+		pa = i * PAGESIZE;
+		if (!(mem_pageinfo[i].flags & PI_AVAIL))
+			continue;
+		mem_pageinfo[i].flags &= ~PI_AVAIL;
+		if (i < 2 || (pa >= MEM_IO && pa < MEM_EXT)
+				|| (pa >= mem_kernlo && pa < mem_kernhi))
+			continue;
+
 		// A free page has no references to it.
 		mem_pageinfo[i].refcount = 0;
+		mem_buddy_put(&mem_pageinfo[i], 0);
+		mem_ninit++;
+	}
+	mcslock_release(&mem_freelock);
+}
+
+//
+// Initialize the next chunk of physical memory not yet initialized.
+// Called by idle CPUs after boot, and when we run out of free pages.
+// Returns false if all physical memory is already initialized
+// (or being initialized by some other CPU).
+//
+bool
+mem_init_more(void)
+{
+	if (mem_nextchunk >= mem_nchunk)
+		return false;
+	uint32_t chunk = xadd(&mem_nextchunk, 1);
+	if (chunk >= mem_nchunk)
+		return false;
+	mem_init_chunk(chunk);
+	return true;
+}
+
+// Insert a free block of 2^order pages onto the appropriate buddy list.
+// Caller must hold mem_freelock.
+static void
+mem_buddy_insert(pageinfo *pi, int order)
+{
+	pageinfo *next = mem_freelist[order];
+	pi->flags |= PI_BUDDY;
+	pi->order = order;
+	pi->free_prev = 0;
+	pi->free_next = mem_pi2link(next);
+	if (next != NULL)
+		next->free_prev = mem_pi2link(pi);
+	mem_freelist[order] = pi;
+	mem_nfree += 1 << order;
+}
+
+// Remove a free block from its buddy list.
+// Caller must hold mem_freelock.
+static void
+mem_buddy_remove(pageinfo *pi)
+{
+	assert(pi->flags & PI_BUDDY);
+	pageinfo *next = mem_link2pi(pi->free_next);
+	pageinfo *prev = mem_link2pi(pi->free_prev);
+	if (prev != NULL)
+		prev->free_next = pi->free_next;
+	else
+		mem_freelist[pi->order] = next;
+	if (next != NULL)
+		next->free_prev = pi->free_prev;
+	pi->flags &= ~PI_BUDDY;
+	pi->free_next = 0;
+	pi->free_prev = 0;	// also leaves refcount zero
+	mem_nfree -= 1 << pi->order;
+}
 
-		// Add the page to the end of the free list.
-		*freetail = &mem_pageinfo[i];
-		freetail = &mem_pageinfo[i].free_next;
+// Take a block of 2^order pages off the buddy lists,
+// splitting a larger block if no block of the right size is free.
+// Returns NULL if no large enough block is available.
+// Caller must hold mem_freelock.
+static pageinfo *
+mem_buddy_get(int order)
+{
+	int k;
+	for (k = order; k <= MEM_MAXORDER; k++)
+		if (mem_freelist[k] != NULL)
+			break;
+	if (k > MEM_MAXORDER)
+		return NULL;
+
+	// Split the block in half until it's the requested size,
+	// returning each upper half to the next-lower free list.
+	pageinfo *pi = mem_freelist[k];
+	mem_buddy_remove(pi);
+	while (k > order) {
+		k--;
+		mem_buddy_insert(pi + (1 << k), k);
 	}
-	*freetail = NULL;	// null-terminate the freelist
+	return pi;
+}
 
-	// ...and remove this when you're ready.
-	panic("mem_init() not implemented");
+// Return a block of 2^order pages to the buddy lists,
+// coalescing it with its buddy for as long as the buddy is also free.
+// Caller must hold mem_freelock.
+static void
+mem_buddy_put(pageinfo *pi, int order)
+{
+	uint32_t idx = pi - mem_pageinfo;
+	assert((idx & ((1 << order) - 1)) == 0);	// properly aligned?
 
-	// Check to make sure the page allocator seems to work correctly.
-	mem_check();
+	while (order < MEM_MAXORDER) {
+		uint32_t bidx = idx ^ (1 << order);
+		if (bidx >= mem_npage)
+			break;
+		pageinfo *buddy = &mem_pageinfo[bidx];
+		if (!(buddy->flags & PI_BUDDY) || buddy->order != order)
+			break;
+		mem_buddy_remove(buddy);
+		idx &= ~(1 << order);
+		order++;
+	}
+	mem_buddy_insert(&mem_pageinfo[idx], order);
+}
+
+// Pop up to n pages off lock-free stack st in one atomic operation,
+// returning the chain's first page (or NULL) and its last page in *tail.
+// The walk down the chain may read links that other CPUs are changing,
+// but then the tag will have changed too and the compare-and-swap fails;
+// the reads themselves are harmless because links are always page indexes.
+static pageinfo *
+mem_stack_pop(volatile memstack *st, int n, pageinfo **tail, int *count)
+{
+	memstack old, new;
+	pageinfo *head, *pi;
+	int i;
+	do {
+		old = *st;
+		head = mem_link2pi(MEMSTACK_LINK(old));
+		if (head == NULL)
+			return NULL;
+		pi = head;
+		for (i = 1; i < n && pi->free_next != 0; i++)
+			pi = mem_link2pi(pi->free_next);
+		new = MEMSTACK(pi->free_next, MEMSTACK_TAG(old) + 1);
+	} while (cmpxchg8b(st, old, new) != old);
+
+	*tail = pi;
+	*count = i;
+	return head;
+}
+
+// Push a chain of pages from head to tail onto lock-free stack st.
+static void
+mem_stack_push(volatile memstack *st, pageinfo *head, pageinfo *tail)
+{
+	memstack old, new;
+	do {
+		old = *st;
+		tail->free_next = MEMSTACK_LINK(old);
+		new = MEMSTACK(mem_pi2link(head), MEMSTACK_TAG(old) + 1);
+	} while (cmpxchg8b(st, old, new) != old);
+}
+
+// Empty the global page stack onto the buddy lists,
+// letting its pages coalesce into larger blocks again.
+static void
+mem_stack_flush(void)
+{
+	pageinfo *tail, *pi, *next;
+	int n;
+	pi = mem_stack_pop(&mem_pagestack, mem_npage, &tail, &n);
+
+	mcslock_acquire(&mem_freelock);
+	for (; n > 0; n--, pi = next) {
+		next = mem_link2pi(pi->free_next);
+		mem_buddy_put(pi, 0);
+	}
+	mcslock_release(&mem_freelock);
+}
+
+// Move up to n pages into CPU c's magazine,
+// from the lock-free page stack if possible, else from the buddy lists.
+// Returns the number of pages actually moved.
+static int
+mem_refill(cpu *c, int n)
+{
+	pageinfo *head, *tail, *pi;
+	int i;
+	head = mem_stack_pop(&mem_pagestack, n, &tail, &i);
+	if (head != NULL) {
+		tail->free_next = mem_pi2link(c->mem_mag);
+		c->mem_mag = head;
+		c->mem_magcount += i;
+		return i;
+	}
+
+	head = c->mem_mag;
+	do {
+		mcslock_acquire(&mem_freelock);
+		for (i = 0; i < n && (pi = mem_buddy_get(0)) != NULL; i++) {
+			pi->free_next = mem_pi2link(head);
+			head = pi;
+		}
+		mcslock_release(&mem_freelock);
+	} while (i == 0 && mem_init_more());	// more memory not yet set up?
+
+	// As a last resort, hand out pages from the pre-zeroed pool.
+	if (i == 0 && (pi = mem_stack_pop(&mem_zerostack, n, &tail, &i))) {
+		xadd(&mem_nzero, -i);
+		tail->free_next = mem_pi2link(head);
+		head = pi;
+	}
+
+	c->mem_mag = head;
+	c->mem_magcount += i;
+	return i;
+}
+
+// Return up to n pages from CPU c's magazine to the global page stack.
+static void
+mem_drain(cpu *c, int n)
+{
+	pageinfo *head = c->mem_mag, *tail = NULL, *pi;
+	int i;
+	for (i = 0, pi = head; i < n && pi != NULL; i++) {
+		tail = pi;
+		pi = mem_link2pi(pi->free_next);
+	}
+	if (tail == NULL)
+		return;
+	c->mem_mag = pi;
+	c->mem_magcount -= i;
+
+	mem_stack_push(&mem_pagestack, head, tail);
 }
 
 //
@@ -107,25 +571,579 @@ mem_init(void)
 //   - a pointer to the page's pageinfo struct if successful
 //   - NULL if no available physical pages.
 //
-// Hint: pi->refs should not be incremented 
-// Hint: be sure to use proper mutual exclusion for multiprocessor operation.
+// Pages come from the current CPU's magazine whenever possible.
+// The kernel runs with interrupts disabled, so nothing else can touch
+// this CPU's magazine while we're working on it.  The one exception
+// is the profiling timer (see kern/prof.h), whose handler never allocates.
 pageinfo *
 mem_alloc(void)
 {
-	// Fill this function in
-	// Fill this function in.
-	panic("mem_alloc not implemented.");
+	cpu *c = cpu_cur();
+	mem_cpustats *st = &percpu_on(c, mem_stats);
+	uint64_t t0 = mem_stats_begin(st, MEM_OP_ALLOC);
+	if (c->mem_magcount == 0 && mem_refill(c, MEM_MAGBATCH) == 0) {
+		st->nop[MEM_OP_ALLOC]--;
+		st->nfail++;
+		return NULL;
+	}
+
+	pageinfo *pi = c->mem_mag;
+	c->mem_mag = mem_link2pi(pi->free_next);
+	c->mem_magcount--;
+	pi->free_next = 0;
+	mem_stats_end(st, MEM_OP_ALLOC, t0);
+	return pi;
 }
 
 //
 // Return a page to the free list, given its pageinfo pointer.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// (This function should only be called when pi->refcount reaches 0.)
 //
 void
 mem_free(pageinfo *pi)
 {
-	// Fill this function in.
-	panic("mem_free not implemented.");
+	assert(pi->refcount == 0);
+
+	cpu *c = cpu_cur();
+	mem_cpustats *st = &percpu_on(c, mem_stats);
+	uint64_t t0 = mem_stats_begin(st, MEM_OP_FREE);
+	pi->free_next = mem_pi2link(c->mem_mag);
+	c->mem_mag = pi;
+	if (++c->mem_magcount > st->magpeak)
+		st->magpeak = c->mem_magcount;
+	if (c->mem_magcount >= MEM_MAGMAX)
+		mem_drain(c, MEM_MAGBATCH);
+	mem_stats_end(st, MEM_OP_FREE, t0);
+}
+
+//
+// Allocate up to n physical pages at once, returning the number allocated.
+// The pages are chained through their free_next links, starting at *chain
+// and ending with a null link; the caller may reuse free_next afterwards.
+// Each refill of our magazine costs a single CAS on the global page stack,
+// or a single acquisition of the buddy list lock,
+// so a large batch costs far less than calling mem_alloc() n times.
+//
+int
+mem_alloc_n(pageinfo **chain, int n)
+{
+	cpu *c = cpu_cur();
+	while (c->mem_magcount < n)
+		if (mem_refill(c, n - c->mem_magcount) == 0) {
+			n = c->mem_magcount;	// settle for what we have
+			break;
+		}
+	if (n == 0) {
+		percpu_on(c, mem_stats).nfail++;
+		*chain = NULL;
+		return 0;
+	}
+	percpu_on(c, mem_stats).nop[MEM_OP_ALLOC] += n;
+
+	pageinfo *head = c->mem_mag, *tail = head;
+	int i;
+	for (i = 1; i < n; i++)
+		tail = mem_link2pi(tail->free_next);
+	c->mem_mag = mem_link2pi(tail->free_next);
+	c->mem_magcount -= n;
+	tail->free_next = 0;
+	*chain = head;
+	return n;
+}
+
+//
+// Free a chain of pages linked through their free_next fields,
+// such as mem_alloc_n() returns, ending with a null link.
+// The chain goes into our magazine if it fits,
+// and otherwise onto the global page stack with a single CAS.
+//
+void
+mem_free_n(pageinfo *head)
+{
+	if (head == NULL)
+		return;
+
+	pageinfo *tail = head;
+	int n = 1;
+	assert(head->refcount == 0);
+	for (; tail->free_next != 0; n++) {
+		tail = mem_link2pi(tail->free_next);
+		assert(tail->refcount == 0);
+	}
+
+	cpu *c = cpu_cur();
+	percpu_on(c, mem_stats).nop[MEM_OP_FREE] += n;
+	if (c->mem_magcount + n > MEM_MAGMAX) {
+		mem_stack_push(&mem_pagestack, head, tail);
+		return;
+	}
+	tail->free_next = mem_pi2link(c->mem_mag);
+	c->mem_mag = head;
+	c->mem_magcount += n;
+}
+
+// Free all the pages queued on a batch by mem_decref_batch().
+void
+mem_batch_flush(mem_batch *b)
+{
+	mem_free_n(b->head);
+	b->head = NULL;
+	b->count = 0;
+}
+
+// Clear a page without pulling it into the cache if we can,
+// since whoever eventually allocates it may run on another CPU anyway.
+static void
+mem_zero_page(void *va)
+{
+	if (!mem_nontemporal) {
+		memset(va, 0, PAGESIZE);
+		return;
+	}
+
+	uint32_t *p, *e = (uint32_t *) va + PAGESIZE/4;
+	for (p = va; p < e; p += 4)
+		asm volatile("movnti %1,0(%0); movnti %1,4(%0);"
+			"movnti %1,8(%0); movnti %1,12(%0)"
+			: : "r" (p), "r" (0) : "memory");
+	asm volatile("sfence" : : : "memory");	// order the weak stores
+}
+
+//
+// Allocate a physical page whose contents are all zero.
+// Takes a page from the pool of pages zeroed ahead of time if possible,
+// and otherwise falls back on mem_alloc() and clears the page itself.
+//
+pageinfo *
+mem_alloc_zeroed(void)
+{
+	pageinfo *pi, *tail;
+	int n;
+	if ((pi = mem_stack_pop(&mem_zerostack, 1, &tail, &n)) != NULL) {
+		xadd(&mem_nzero, -1);
+		lockadd(&mem_zero_hits, 1);
+		percpu(mem_stats).nop[MEM_OP_ALLOC]++;
+		pi->free_next = 0;
+		return pi;
+	}
+
+	lockadd(&mem_zero_misses, 1);
+	if ((pi = mem_alloc()) != NULL)
+		memset(mem_pi2ptr(pi), 0, PAGESIZE);
+	return pi;
+}
+
+//
+// Zero one free page and add it to the pre-zeroed pool,
+// unless the pool is already full or we're out of memory.
+// Called by CPUs with nothing better to do.
+// Returns true if it did any work.
+//
+bool
+mem_zero_idle(void)
+{
+	if (mem_nzero >= MEM_ZEROMAX)
+		return false;
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return false;
+
+	// A pooled page is free again as far as the statistics go:
+	// mem_alloc_zeroed(), or mem_alloc() after mem_refill() takes it,
+	// counts it again when handing it out.
+	mem_zero_page(mem_pi2ptr(pi));
+	xadd(&mem_nzero, 1);
+	mem_stack_push(&mem_zerostack, pi, pi);
+	percpu(mem_stats).nop[MEM_OP_FREE]++;
+	lockadd(&mem_zero_idled, 1);
+	return true;
+}
+
+// Print pre-zeroed page pool statistics.
+void
+mem_zero_stats(void)
+{
+	cprintf("mem_zero_stats: %d pages pooled, %d hits, %d misses, "
+		"%d zeroed while idle%s\n", mem_nzero, mem_zero_hits,
+		mem_zero_misses, mem_zero_idled,
+		mem_nontemporal ? "" : " (no MOVNTI)");
+}
+
+//
+// Allocate a physically contiguous, naturally aligned block
+// of 2^order pages, returning the pageinfo of its first page.
+// Like mem_alloc(), does NOT zero the pages or touch any refcounts.
+// Returns NULL if no large enough contiguous block is available.
+//
+pageinfo *
+mem_alloc_order(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	if (order == 0)
+		return mem_alloc();
+
+	mcslock_acquire(&mem_freelock);
+	pageinfo *pi = mem_buddy_get(order);
+	mcslock_release(&mem_freelock);
+
+	// Pages sitting in our own magazine or on the page stack
+	// can't coalesce; give them back to the buddy lists and try once more.
+	if (pi == NULL) {
+		mem_drain(cpu_cur(), MEM_MAGMAX);
+		mem_stack_flush();
+		mcslock_acquire(&mem_freelock);
+		pi = mem_buddy_get(order);
+		mcslock_release(&mem_freelock);
+	}
+
+	// Then initialize any memory we haven't gotten around to yet.
+	while (pi == NULL && mem_init_more()) {
+		mcslock_acquire(&mem_freelock);
+		pi = mem_buddy_get(order);
+		mcslock_release(&mem_freelock);
+	}
+
+	lockadd(pi != NULL ? &mem_nalloc_order[order]
+			: &mem_nfail_order[order], 1);
+	if (pi != NULL)
+		percpu(mem_stats).nop[MEM_OP_ALLOC] += 1 << order;
+	else
+		percpu(mem_stats).nfail++;
+	return pi;
+}
+
+//
+// Free a block of 2^order pages previously obtained from mem_alloc_order().
+//
+void
+mem_free_order(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	assert(pi->refcount == 0);
+	if (order == 0) {
+		mem_free(pi);
+		return;
+	}
+
+	mcslock_acquire(&mem_freelock);
+	mem_buddy_put(pi, order);
+	mcslock_release(&mem_freelock);
+	percpu(mem_stats).nop[MEM_OP_FREE] += 1 << order;
+}
+
+//
+// Switch a page the caller holds a reference to into shared mode.
+// A shared page takes one extra "bias" reference of its own,
+// so pi->refcount stays nonzero however the CPUs' deltas drift
+// and no mem_decref() can free it while it's shared.
+// After this, mem_incref() and mem_decref() just adjust the calling CPU's
+// private delta for the page's slot, instead of pi->refcount.
+// Sharing an already-shared page does nothing; returns false,
+// leaving the page unshared, if all MEM_SHAREMAX slots are in use.
+//
+bool
+mem_share(pageinfo *pi)
+{
+	assert(pi->refcount > 0);	// Caller must hold a reference
+
+	spinlock_acquire(&mem_sharelock);
+	int s = 0;
+	if (!(pi->flags & PI_SHARED))
+		while (s < MEM_SHAREMAX && mem_sharedpage[s] != NULL)
+			s++;
+	if (s == MEM_SHAREMAX) {
+		spinlock_release(&mem_sharelock);
+		return false;
+	}
+	if (!(pi->flags & PI_SHARED)) {
+		mem_sharedpage[s] = pi;
+		lockadd(&pi->refcount, 1);	// the bias reference
+		pi->slot = s;
+		lockorw(&pi->flags, PI_SHARED);
+	}
+	spinlock_release(&mem_sharelock);
+	return true;
+}
+
+//
+// Add delta to the calling CPU's count of references to a shared page.
+// Only the owning CPU ever writes its delta, so this needs no atomics;
+// the deltas of all CPUs may individually go negative,
+// but together with pi->refcount they sum to the true count.
+// Returns false if the page turns out not to be shared after all,
+// in which case the caller must apply delta to pi->refcount itself.
+//
+bool
+mem_shared_add(pageinfo *pi, int delta)
+{
+	cpu *c = cpu_cur();
+
+	// Announce that we may be touching a delta before checking PI_SHARED.
+	// The xchg is a full barrier, so a concurrent mem_unshare()
+	// either sees us busy and waits, or we see the page unshared.
+	xchg(&c->mem_refbusy, 1);
+	asm volatile("" : : : "memory");
+	bool shared = (pi->flags & PI_SHARED) != 0;
+	if (shared)
+		percpu_on(c, mem_refdelta).delta[pi->slot] += delta;
+	c->mem_refbusy = 0;
+	return shared;
+}
+
+//
+// Take a shared page back to ordinary reference counting:
+// fold every CPU's delta for the page into pi->refcount,
+// then drop the bias reference mem_share() took.
+// While we collect the deltas, other CPUs already decrement pi->refcount
+// directly for references they took while the page was shared,
+// so a large temporary bias keeps it from reaching zero until the
+// deltas that account for those references have been folded in.
+// If that was the last reference, because all other references were
+// dropped while the page was shared, freefun runs here to free the page,
+// on the calling CPU and after mem_sharelock has been released.
+//
+void
+mem_unshare(pageinfo *pi, void (*freefun)(pageinfo *pi))
+{
+	spinlock_acquire(&mem_sharelock);
+	assert(pi->flags & PI_SHARED);
+	int s = pi->slot;
+	assert(mem_sharedpage[s] == pi);
+
+	// Send all further reference count changes to pi->refcount,
+	// wait for any CPU still updating its delta to finish,
+	// then collect and clear every CPU's delta.
+	lockadd(&pi->refcount, MEM_UNSHAREBIAS);
+	lockandw(&pi->flags, (uint16_t) ~PI_SHARED);
+	int32_t sum = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		while (c->mem_refbusy)
+			pause();
+		sum += percpu_on(c, mem_refdelta).delta[s];
+		percpu_on(c, mem_refdelta).delta[s] = 0;
+	}
+	lockadd(&pi->refcount, sum - MEM_UNSHAREBIAS);
+	mem_sharedpage[s] = NULL;
+	spinlock_release(&mem_sharelock);
+
+	assert(pi->refcount >= 1);	// including the bias reference
+	mem_decref(pi, freefun);	// drop the bias
+}
+
+//
+// Print per-CPU page allocator statistics:
+// operation and failure counts, current and peak magazine occupancy,
+// and a log2 histogram of sampled latencies for each kind of operation.
+// Reads other CPUs' counters without synchronization,
+// so the numbers may be slightly stale, but never unsafe to print.
+//
+void
+mem_stats_print(void)
+{
+	static const char *opname[MEM_NOP] = {
+		"alloc", "free", "incref", "decref" };
+	uint32_t nalloc = 0, nfree = 0;
+	cpu *c;
+	int i, b;
+
+	cprintf("mem_stats: cpu   allocs    frees  fails   increfs   decrefs"
+		" mag peak\n");
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		mem_cpustats *st = &percpu_on(c, mem_stats);
+		cprintf("mem_stats: %3d %8u %8u %6u %9u %9u %3d %4u\n", c->id,
+			st->nop[MEM_OP_ALLOC], st->nop[MEM_OP_FREE], st->nfail,
+			st->nop[MEM_OP_INCREF], st->nop[MEM_OP_DECREF],
+			c->mem_magcount, st->magpeak);
+		nalloc += st->nop[MEM_OP_ALLOC];
+		nfree += st->nop[MEM_OP_FREE];
+	}
+	cprintf("mem_stats: %u pages free (%u on buddy lists, %u pre-zeroed)\n",
+		mem_ninit - nalloc + nfree, mem_nfree, mem_nzero);
+
+	// Histograms of sampled latencies, summed over all CPUs
+	for (i = 0; i < MEM_NOP; i++) {
+		cprintf("mem_stats: %s cycles:", opname[i]);
+		for (b = 0; b < MEM_NHIST; b++) {
+			uint32_t n = 0;
+			for (c = &cpu_boot; c != NULL; c = c->next)
+				n += percpu_on(c, mem_stats).hist[i][b];
+			if (n != 0)
+				cprintf(" %u-%u:%u", b ? 1u << b : 0,
+					(2u << b) - 1, n);
+		}
+		cprintf("\n");
+	}
+}
+
+// Work out the number of page colors from the geometry of the largest
+// data or unified cache, as reported by CPUID function 4:
+// the number of pages it takes to fill one way of the cache.
+static void
+mem_color_init(void)
+{
+	cpuinfo inf;
+	uint32_t bestsize = 0, waysize = 0;
+	int i;
+
+	cpuid(0, &inf);
+	bool leaf4 = inf.eax >= 4;	// deterministic cache parameters
+	for (i = 0; leaf4; i++) {
+		cpuid_sub(4, i, &inf);
+		int type = inf.eax & 0x1f;	// 0 = no more caches
+		if (type == 0)
+			break;
+		if (type == 2)			// instruction cache
+			continue;
+		uint32_t ways = (inf.ebx >> 22) + 1;
+		uint32_t parts = ((inf.ebx >> 12) & 0x3ff) + 1;
+		uint32_t line = (inf.ebx & 0xfff) + 1;
+		uint32_t sets = inf.ecx + 1;
+		if (ways * parts * line * sets > bestsize) {
+			bestsize = ways * parts * line * sets;
+			waysize = parts * line * sets;
+			mem_colorways = ways;
+		}
+	}
+
+	mem_ncolor = 1;
+	while (mem_ncolor < MEM_MAXCOLOR && mem_ncolor*2*PAGESIZE <= waysize)
+		mem_ncolor *= 2;
+	if (bestsize == 0)
+		warn("mem_color_init: no cache geometry; page coloring disabled");
+	else
+		cprintf("Page coloring: %d colors for %dK %d-way cache\n",
+			mem_ncolor, bestsize / 1024, mem_colorways);
+}
+
+// Split free buddy blocks onto the color lists, preferring a block
+// big enough to hold every color, until there is a page of the given color.
+// Pages of other colors whose lists already hold MEM_COLORMAX pages
+// go straight back to the buddy lists, so they can't pile up where
+// only mem_alloc_color() would ever find them.
+// Called with mem_freelock held.  Returns false if none could be found.
+static bool
+mem_color_refill(int color)
+{
+	int order = 0, tries, i;
+	while ((1 << order) < mem_ncolor)
+		order++;
+
+	for (tries = 0; tries < MEM_COLORTRIES; tries++) {
+		pageinfo *pi = NULL;
+		int k;
+		for (k = order; k >= 0 && pi == NULL; k--)
+			pi = mem_buddy_get(k);
+		if (pi == NULL)
+			return false;
+		for (i = 0; i < (1 << (k+1)); i++) {
+			int c = mem_pi2color(&pi[i]);
+			if (c != color && mem_colorcount[c] >= MEM_COLORMAX) {
+				mem_buddy_put(&pi[i], 0);
+				continue;
+			}
+			pi[i].free_next = mem_pi2link(mem_colorlist[c]);
+			mem_colorlist[c] = &pi[i];
+			mem_colorcount[c]++;
+		}
+		if (mem_colorlist[color] != NULL)
+			return true;
+	}
+	return false;
+}
+
+pageinfo *
+mem_alloc_color(int color)
+{
+	cpu *c = cpu_cur();
+	if (color == MEM_COLOR_NEXT) {
+		color = c->mem_color & (mem_ncolor-1);
+		c->mem_color = (color + 1) & (mem_ncolor-1);
+	}
+	assert(color >= 0 && color < mem_ncolor);
+
+	pageinfo *pi;
+	do {
+		mcslock_acquire(&mem_freelock);
+		if ((pi = mem_colorlist[color]) != NULL
+				|| (mem_color_refill(color)
+				    && (pi = mem_colorlist[color]) != NULL)) {
+			mem_colorlist[color] = mem_link2pi(pi->free_next);
+			mem_colorcount[color]--;
+			pi->free_next = 0;
+		}
+		mcslock_release(&mem_freelock);
+	} while (pi == NULL && mem_init_more());
+
+	if (pi != NULL)
+		percpu_on(c, mem_stats).nop[MEM_OP_ALLOC]++;
+	else
+		percpu_on(c, mem_stats).nfail++;
+	return pi;
+}
+
+void
+mem_free_color(pageinfo *pi)
+{
+	assert(pi->refcount == 0);
+	int color = mem_pi2color(pi);
+
+	mcslock_acquire(&mem_freelock);
+	if (mem_colorcount[color] < MEM_COLORMAX) {
+		pi->free_next = mem_pi2link(mem_colorlist[color]);
+		mem_colorlist[color] = pi;
+		mem_colorcount[color]++;
+	} else
+		mem_buddy_put(pi, 0);
+	mcslock_release(&mem_freelock);
+	percpu(mem_stats).nop[MEM_OP_FREE]++;
+}
+
+// Return all pages on the color lists to the buddy lists.
+static void
+mem_color_flush(void)
+{
+	int c;
+	mcslock_acquire(&mem_freelock);
+	for (c = 0; c < mem_ncolor; c++) {
+		pageinfo *pi;
+		while ((pi = mem_colorlist[c]) != NULL) {
+			mem_colorlist[c] = mem_link2pi(pi->free_next);
+			mem_buddy_put(pi, 0);
+		}
+		mem_colorcount[c] = 0;
+	}
+	mcslock_release(&mem_freelock);
+}
+
+// Print buddy allocator fragmentation statistics:
+// the free block count at each order, allocation successes and failures,
+// and for each order the fraction of free memory that is unusable
+// for an allocation of that order because it's in smaller blocks.
+//
+void
+mem_buddy_stats(void)
+{
+	size_t above = 0;	// free pages in blocks of order >= k
+	int k;
+
+	mcslock_acquire(&mem_freelock);
+	cprintf("mem_buddy_stats: %d pages free in buddy lists\n",
+		(int)mem_nfree);
+	cprintf("  order  blocks  allocs  fails  unusable\n");
+	for (k = MEM_MAXORDER; k >= 0; k--) {
+		int nblocks = 0;
+		pageinfo *pi;
+		for (pi = mem_freelist[k]; pi != NULL;
+				pi = mem_link2pi(pi->free_next))
+			nblocks++;
+		above += nblocks << k;
+		int unusable = mem_nfree ? (mem_nfree - above) * 100 / mem_nfree
+					: 0;
+		cprintf("  %5d  %6d  %6d  %5d  %7d%%\n", k, nblocks,
+			mem_nalloc_order[k], mem_nfail_order[k], unusable);
+	}
+	mcslock_release(&mem_freelock);
 }
 
 //
@@ -136,17 +1154,40 @@ void
 mem_check()
 {
 	pageinfo *pp, *pp0, *pp1, *pp2;
-	pageinfo *fl;
-	int i;
+	pageinfo *fl[MEM_MAXORDER+1];
+	memstack flstack;
+	size_t nfl;
+	int i, k;
+
+	// with "bench", time a bare walk over the free lists,
+	// to gauge metadata locality
+	if (boot_option("bench")) {
+		int freeblocks = 0;
+		uint64_t t0 = rdtsc();
+		for (k = 0; k <= MEM_MAXORDER; k++)
+			for (pp = mem_freelist[k]; pp != 0;
+					pp = mem_link2pi(pp->free_next))
+				freeblocks++;
+		cprintf("mem_check: walked %d free blocks in %lld cycles\n",
+			freeblocks, rdtsc() - t0);
+	}
 
         // if there's a page that shouldn't be on
         // the free list, try to make sure it
         // eventually causes trouble.
 	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
+	for (pp = mem_link2pi(MEMSTACK_LINK(mem_pagestack)); pp != 0;
+			pp = mem_link2pi(pp->free_next)) {
 		memset(mem_pi2ptr(pp), 0x97, 128);
 		freepages++;
 	}
+	for (k = 0; k <= MEM_MAXORDER; k++)
+		for (pp = mem_freelist[k]; pp != 0;
+				pp = mem_link2pi(pp->free_next))
+			for (i = 0; i < (1 << k); i++) {
+				memset(mem_pi2ptr(pp + i), 0x97, 128);
+				freepages++;
+			}
 	cprintf("mem_check: %d free pages\n", freepages);
 	assert(freepages < mem_npage);	// can't have more free than total!
 	assert(freepages > 16000);	// make sure it's in the right ballpark
@@ -164,12 +1205,21 @@ mem_check()
         assert(mem_pi2phys(pp1) < mem_npage*PAGESIZE);
         assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
-	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	// temporarily steal the rest of the free pages,
+	// including any our own magazine is holding
+	mem_drain(cpu_cur(), MEM_MAGMAX);
+	for (k = 0; k <= MEM_MAXORDER; k++) {
+		fl[k] = mem_freelist[k];
+		mem_freelist[k] = 0;
+	}
+	nfl = mem_nfree;
+	mem_nfree = 0;
+	flstack = mem_pagestack;
+	mem_pagestack = 0;
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
+	assert(mem_alloc_n(&pp, 5) == 0 && pp == NULL);
 
         // free and re-allocate?
         mem_free(pp0);
@@ -184,14 +1234,384 @@ mem_check()
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 	assert(mem_alloc() == 0);
 
+	// batched alloc and free should settle for the pages there are
+	mem_free(pp0);
+	mem_free(pp1);
+	mem_free(pp2);
+	assert(mem_alloc_n(&pp, 5) == 3);
+	pp0 = pp;
+	pp1 = mem_link2pi(pp0->free_next);
+	pp2 = mem_link2pi(pp1->free_next);
+	assert(pp2->free_next == 0);
+	assert(pp1 != pp0 && pp2 != pp1 && pp2 != pp0);
+	mem_free_n(pp0);
+	assert(mem_alloc_n(&pp, 3) == 3);
+	assert(mem_alloc() == 0);
+	pp0 = pp;
+	pp1 = mem_link2pi(pp0->free_next);
+	pp2 = mem_link2pi(pp1->free_next);
+
 	// give free list back
-	mem_freelist = fl;
+	for (k = 0; k <= MEM_MAXORDER; k++)
+		mem_freelist[k] = fl[k];
+	mem_nfree = nfl;
+	mem_pagestack = flstack;
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
 
+	// contiguous blocks should be naturally aligned,
+	// and should coalesce back into the same size when freed
+	size_t nfree = mem_nfree;
+	pp0 = mem_alloc_order(3); assert(pp0 != 0);
+	assert(((pp0 - mem_pageinfo) & 7) == 0);
+	pp1 = mem_alloc_order(3); assert(pp1 != 0 && pp1 != pp0);
+	assert(mem_nfree == nfree - 16);
+	mem_free_order(pp1, 3);
+	mem_free_order(pp0, 3);
+	assert(mem_nfree == nfree);
+
+	// batches bigger than a magazine should come back whole,
+	// and pages queued by mem_decref_batch() only get freed on a flush
+	mem_batch b = MEM_BATCH_INIT;
+	k = mem_alloc_n(&pp, 3*MEM_MAGMAX);
+	assert(k == 3*MEM_MAGMAX);
+	for (pp0 = pp, i = 0; pp0 != NULL; pp0 = mem_link2pi(pp0->free_next))
+		i++;
+	assert(i == k);
+	mem_free_n(pp);
+	mem_drain(cpu_cur(), MEM_MAGMAX);	// so the flush below fits
+	k = mem_alloc_n(&pp, 8);
+	assert(k == 8);
+	int nmag = cpu_cur()->mem_magcount;
+	for (pp0 = pp; pp0 != NULL; pp0 = pp1) {
+		pp1 = mem_link2pi(pp0->free_next);
+		pp0->free_next = 0;
+		mem_incref(pp0);
+		mem_incref(pp0);
+		mem_decref_batch(pp0, &b);
+		assert(b.count == 0);
+		mem_decref_batch(pp0, &b);
+	}
+	assert(b.count == k);
+	mem_batch_flush(&b);
+	assert(b.count == 0 && b.head == NULL);
+	assert(cpu_cur()->mem_magcount == nmag + k);
+
+	// zeroed pages should come back clean, whether pre-zeroed or not
+	assert(mem_zero_idle());
+	pp0 = mem_alloc_zeroed(); assert(pp0 != 0);
+	pp1 = mem_alloc_zeroed(); assert(pp1 != 0 && pp1 != pp0);
+	for (i = 0; i < PAGESIZE/4; i++) {
+		assert(((uint32_t *) mem_pi2ptr(pp0))[i] == 0);
+		assert(((uint32_t *) mem_pi2ptr(pp1))[i] == 0);
+	}
+	mem_free(pp0);
+	mem_free(pp1);
+
+	// shared pages count references the same, just not in pi->refcount,
+	// and only get freed when unshared
+	pp0 = mem_alloc(); assert(pp0 != 0);
+	mem_incref(pp0);
+	assert(mem_share(pp0) && (pp0->flags & PI_SHARED));
+	assert(pp0->refcount == 2);		// our reference plus the bias
+	for (i = 0; i < 10; i++)
+		mem_incref(pp0);
+	for (i = 0; i < 11; i++)
+		mem_decref(pp0, mem_check_free);
+	assert(pp0->refcount == 2 && mem_check_freed == NULL);
+	mem_unshare(pp0, mem_check_free);
+	assert(!(pp0->flags & PI_SHARED) && mem_check_freed == pp0);
+	mem_check_freed = NULL;
+
+	pp0 = mem_alloc(); assert(pp0 != 0);
+	mem_incref(pp0);
+	assert(mem_share(pp0));
+	mem_incref(pp0);
+	mem_unshare(pp0, mem_check_free);
+	assert(pp0->refcount == 2 && mem_check_freed == NULL);
+	mem_decref(pp0, mem_check_free);
+	mem_decref(pp0, mem_check_free);
+	assert(mem_check_freed == pp0);
+	mem_check_freed = NULL;
+
+	mem_color_check();
+
 	cprintf("mem_check() succeeded!\n");
 }
 
+// Stream through a set of pages a cache line at a time, several times over,
+// returning the average cycles per line.
+static uint32_t
+mem_color_stream(pageinfo **pg, int n)
+{
+	static volatile uint32_t sink;
+	uint32_t sum = 0;
+	int pass, i, off;
+
+	uint64_t t0 = rdtsc();
+	for (pass = 0; pass < 64; pass++)
+		for (i = 0; i < n; i++) {
+			uint8_t *p = mem_pi2ptr(pg[i]);
+			for (off = 0; off < PAGESIZE; off += 64)
+				sum += *(volatile uint32_t *)(p + off);
+		}
+	uint64_t cyc = rdtsc() - t0;
+	sink = sum;
+	return cyc / (64 * n * (PAGESIZE/64));
+}
+
+// Check colored allocation, and with "bench", measure its effect on a workload
+// streaming through twice as many buffer pages as the cache has ways:
+// all of them fit in the cache if their colors differ,
+// but they thrash the same few sets if they all have the same color.
+static void
+mem_color_check(void)
+{
+	static pageinfo *pg[64];
+	int i, n;
+
+	// we should get exactly the colors we ask for, or the next in turn
+	for (i = 0; i < mem_ncolor; i++) {
+		pageinfo *pi = mem_alloc_color(i);
+		assert(pi != NULL && mem_pi2color(pi) == i);
+		mem_free_color(pi);
+	}
+	pg[0] = mem_alloc_color(MEM_COLOR_NEXT);
+	pg[1] = mem_alloc_color(MEM_COLOR_NEXT);
+	assert(pg[0] != NULL && pg[1] != NULL);
+	assert(mem_pi2color(pg[1]) == ((mem_pi2color(pg[0]) + 1)
+					& (mem_ncolor-1)));
+	mem_free_color(pg[0]);
+	mem_free_color(pg[1]);
+
+	// Comparing streaming bandwidth is a benchmark, not a check.
+	if (mem_ncolor == 1 || !boot_option("bench")) {
+		mem_color_flush();
+		return;
+	}
+
+	n = MIN(2 * mem_colorways, MIN(mem_ncolor, 64));
+	for (i = 0; i < n; i++)
+		pg[i] = mem_alloc_color(MEM_COLOR_NEXT);
+	mem_color_stream(pg, n);	// warm up
+	uint32_t colored = mem_color_stream(pg, n);
+	for (i = 0; i < n; i++)
+		mem_free_color(pg[i]);
+
+	for (i = 0; i < n; i++)
+		pg[i] = mem_alloc_color(0);
+	mem_color_stream(pg, n);
+	uint32_t samecolor = mem_color_stream(pg, n);
+	for (i = 0; i < n; i++)
+		mem_free_color(pg[i]);
+
+	for (i = 0; i < n; i++)
+		pg[i] = mem_alloc();
+	mem_color_stream(pg, n);
+	uint32_t plain = mem_color_stream(pg, n);
+	for (i = 0; i < n; i++)
+		mem_free(pg[i]);
+
+	mem_color_flush();
+	cprintf("mem_color_check: streaming %d pages: %u cycles/line colored, "
+		"%u same-colored, %u uncolored\n", n, colored, samecolor, plain);
+}
+
+
+// Parameters for the multiprocessor allocator stress test below.
+// Without "bench" on the command line, just check for correctness
+// with all CPUs at once, for a few rounds; with it, time each kind of pass
+// with 1, 2, ... N CPUs, for many more rounds.
+#define MEM_STRESS_BURST	(MEM_MAGMAX*2)	// pages allocated per burst
+#define MEM_STRESS_ROUNDS	1000		// bursts per CPU per timed pass
+#define MEM_STRESS_POOL		64		// pages in each list benchmark
+#define MEM_STRESS_OPS		100000		// pop/push pairs per timed pass
+#define MEM_STRESS_CHECKDIV	100		// fewer rounds just to check
+
+static int mem_stress_rounds, mem_stress_ops;	// for this boot
+
+// Free page lists for comparing a spinlocked list against a lock-free stack.
+static spinlock mem_stress_lock;
+static pageinfo *mem_stress_list;
+static volatile memstack gcc_aligned(8) mem_stress_stack;
+
+// Pages for comparing atomic against shared-mode reference counts.
+static pageinfo *mem_stress_atomic, *mem_stress_shared;
+
+// Run fn() concurrently on the first n CPUs,
+// and return the cycles elapsed between the pass's starting and ending
+// barriers, which cover the work of all participating CPUs.
+static uint64_t
+mem_stress_pass(int n, void (*fn)(void))
+{
+	cpu_barrier();
+	uint64_t t0 = rdtsc();
+	if (cpu_cur()->id < n)
+		fn();
+	cpu_barrier();
+	return rdtsc() - t0;
+}
+
+// Allocate and free bursts of pages through mem_alloc() and mem_free().
+// Each page is tagged with its owner while allocated,
+// to catch the same page being handed out to two CPUs at once.
+static void
+mem_stress_alloc(void)
+{
+	pageinfo *pis[MEM_STRESS_BURST];
+	uint32_t id = cpu_cur()->id;
+	int r, i;
+	for (r = 0; r < mem_stress_rounds; r++) {
+		for (i = 0; i < MEM_STRESS_BURST; i++) {
+			pis[i] = mem_alloc();
+			assert(pis[i] != NULL);
+			*(volatile uint32_t *)mem_pi2ptr(pis[i]) = id;
+		}
+		for (i = 0; i < MEM_STRESS_BURST; i++) {
+			assert(*(volatile uint32_t *)mem_pi2ptr(pis[i]) == id);
+			mem_free(pis[i]);
+		}
+	}
+}
+
+// Pop a page off a spinlocked list and push it back, repeatedly.
+static void
+mem_stress_locked(void)
+{
+	int r;
+	for (r = 0; r < mem_stress_ops; r++) {
+		spinlock_acquire(&mem_stress_lock);
+		pageinfo *pi = mem_stress_list;
+		assert(pi != NULL);
+		mem_stress_list = mem_link2pi(pi->free_next);
+		spinlock_release(&mem_stress_lock);
+
+		spinlock_acquire(&mem_stress_lock);
+		pi->free_next = mem_pi2link(mem_stress_list);
+		mem_stress_list = pi;
+		spinlock_release(&mem_stress_lock);
+	}
+}
+
+// Pop a page off a lock-free stack and push it back, repeatedly.
+static void
+mem_stress_lockfree(void)
+{
+	pageinfo *pi, *tail;
+	int r, n;
+	for (r = 0; r < mem_stress_ops; r++) {
+		pi = mem_stack_pop(&mem_stress_stack, 1, &tail, &n);
+		assert(pi != NULL && n == 1);
+		mem_stack_push(&mem_stress_stack, pi, pi);
+	}
+}
+
+// Take and drop references to a page, repeatedly.
+static void
+mem_stress_ref(pageinfo *pi)
+{
+	int r;
+	for (r = 0; r < mem_stress_ops; r++) {
+		mem_incref(pi);
+		mem_decref(pi, mem_free);
+	}
+}
+
+static void
+mem_stress_refatomic(void)
+{
+	mem_stress_ref(mem_stress_atomic);
+}
+
+static void
+mem_stress_refshared(void)
+{
+	mem_stress_ref(mem_stress_shared);
+}
+
+//
+// Stress the page allocator from all CPUs at once.
+// If "bench" is on the command line, also report allocator throughput
+// for 1, 2, ... N concurrent CPUs, along with the throughput
+// of a spinlocked page list versus the lock-free page stack
+// the allocator uses, and of atomic versus shared-mode reference counts.
+// Called on every CPU after mem_init(); CPUs not participating
+// in a given pass just wait at the barriers.
+//
+void
+mem_check_mp(void)
+{
+	pageinfo *pi, *tail;
+	bool bench = boot_option("bench");
+	int ncpu = cpu_count(), n, i;
+
+	// The boot CPU sets up the list benchmark before anyone starts;
+	// the barrier at the start of the first pass holds the others back.
+	if (cpu_onboot()) {
+		mem_stress_rounds = MEM_STRESS_ROUNDS;
+		mem_stress_ops = MEM_STRESS_OPS;
+		if (!bench) {
+			mem_stress_rounds /= MEM_STRESS_CHECKDIV;
+			mem_stress_ops /= MEM_STRESS_CHECKDIV;
+		}
+		spinlock_init(&mem_stress_lock);
+		for (i = 0; i < MEM_STRESS_POOL; i++) {
+			pi = mem_alloc();
+			pi->free_next = mem_pi2link(mem_stress_list);
+			mem_stress_list = pi;
+			pi = mem_alloc();
+			mem_stack_push(&mem_stress_stack, pi, pi);
+		}
+		mem_stress_atomic = mem_alloc();
+		mem_incref(mem_stress_atomic);
+		mem_stress_shared = mem_alloc();
+		mem_incref(mem_stress_shared);
+		assert(mem_share(mem_stress_shared));
+	}
+
+	for (n = bench ? 1 : ncpu; n <= ncpu; n++) {
+		uint64_t acyc = mem_stress_pass(n, mem_stress_alloc);
+		uint64_t lcyc = mem_stress_pass(n, mem_stress_locked);
+		uint64_t fcyc = mem_stress_pass(n, mem_stress_lockfree);
+		uint64_t rcyc = mem_stress_pass(n, mem_stress_refatomic);
+		uint64_t scyc = mem_stress_pass(n, mem_stress_refshared);
+		if (!cpu_onboot() || !bench)
+			continue;
+
+		uint64_t allocs = (uint64_t)n * mem_stress_rounds
+					* MEM_STRESS_BURST;
+		uint64_t ops = (uint64_t)n * mem_stress_ops;
+		uint32_t rate = allocs * 1000000 / acyc;
+		cprintf("mem_check_mp: %d CPU(s): %u allocs/Mcycle, "
+			"%u allocs/Mcycle/CPU\n", n, rate, rate / n);
+		cprintf("mem_check_mp: %d CPU(s): spinlocked list %u ops/Mcycle, "
+			"lock-free stack %u ops/Mcycle\n", n,
+			(uint32_t)(ops * 1000000 / lcyc),
+			(uint32_t)(ops * 1000000 / fcyc));
+		cprintf("mem_check_mp: %d CPU(s): atomic refcount %u ops/Mcycle, "
+			"shared refcount %u ops/Mcycle\n", n,
+			(uint32_t)(ops * 1000000 / rcyc),
+			(uint32_t)(ops * 1000000 / scyc));
+	}
+
+	if (cpu_onboot()) {
+		while ((pi = mem_stress_list) != NULL) {
+			mem_stress_list = mem_link2pi(pi->free_next);
+			mem_free(pi);
+		}
+		while ((pi = mem_stack_pop(&mem_stress_stack, 1, &tail, &i)))
+			mem_free(pi);
+		mem_decref(mem_stress_atomic, mem_free);
+		mem_unshare(mem_stress_shared, mem_free);
+		mem_decref(mem_stress_shared, mem_free);
+
+		mem_buddy_stats();
+		mem_zero_stats();
+		mem_stats_print();
+		cprintf("mem_check_mp() succeeded!\n");
+	}
+}
+
@@ -19,6 +19,8 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 
+#include <kern/cpu.h>
+
 
 // At physical address MEM_IO (640K) there is a 384K hole for I/O.
 // The hole ends at physical address MEM_EXT, where extended memory begins.
@@ -40,19 +42,54 @@
 
 // A pageinfo struct holds metadata on how a particular physical page is used.
 // On boot we allocate a big array of pageinfo structs, one per physical page.
-// This could be a union instead of a struct,
-// since only one member is used for a given page state (free, allocated) -
-// but that might make debugging a bit more challenging.
+// To keep the array small, free-list links are 32-bit page indexes
+// (page 0 is never free, so index 0 serves as the null link),
+// and the buddy list back-link shares a word with the reference count:
+// a page on a buddy list has no references, and an allocated page
+// is on no buddy list.  Removing a page from its buddy list
+// clears free_prev, which leaves refcount zero as mem_alloc() promises.
+// The fields touched together by the allocator all share one 12-byte entry.
 typedef struct pageinfo {
-	struct pageinfo	*free_next;	// Next page number on free list
-	int32_t	refcount;		// Reference count on allocated pages
+	uint32_t	free_next;	// Next page number on free list
+	union {
+		int32_t	refcount;	// Reference count on allocated pages
+		uint32_t free_prev;	// Previous block on buddy free list
+	};
+	uint16_t	flags;		// Page state flags (PI_* below)
+	uint8_t		order;		// Log2 of free block size, if PI_BUDDY
+	uint8_t		slot;		// Refcount delta slot, if PI_SHARED
 } pageinfo;
 
+// pageinfo flags
+#define PI_BUDDY	0x01		// Heads a free block on a buddy list
+#define PI_AVAIL	0x02		// Usable RAM, used only during mem_init
+#define PI_SHARED	0x04		// Refcount kept in per-CPU deltas
+
+// Largest physically contiguous block mem_alloc_order() can provide:
+// 2^10 pages, or 4MB - the size of an x86 PSE superpage.
+#define MEM_MAXORDER	10
+
+// Page coloring: pages whose physical page numbers are equal
+// modulo mem_ncolor map to the same sets in the largest cache.
+// mem_ncolor is always a power of two no greater than MEM_MAXCOLOR.
+#define MEM_MAXCOLOR	256
+#define MEM_COLOR_NEXT	(-1)		// Any color, round-robin per CPU
+#define mem_pi2color(pi)	(((pi) - mem_pageinfo) & (mem_ncolor-1))
+
+// Widely shared pages can switch to a scalable reference count mode,
+// in which each CPU counts its own increments and decrements separately.
+// MEM_SHAREMAX pages can be in this mode at once.
+#define MEM_SHAREMAX	64
+
+// Most pages mem_decref_batch() queues up before freeing them.
+#define MEM_BATCHMAX	64
+
 
 // The pmem module sets up the following globals during mem_init().
 extern size_t mem_max;		// Maximum physical address
 extern size_t mem_npage;	// Total number of physical memory pages
 extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
+extern int mem_ncolor;		// Number of page colors
 
 // Convert between pageinfo pointers, page indexes, and physical page addresses
 #define mem_phys2pi(phys)	(&mem_pageinfo[(phys)/PAGESIZE])
@@ -60,6 +97,11 @@ extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
 #define mem_ptr2pi(ptr)		(mem_phys2pi(mem_phys(ptr)))
 #define mem_pi2ptr(pi)		(mem_ptr(mem_pi2phys(pi)))
 
+// Convert between pageinfo pointers and free-list links (page indexes),
+// mapping NULL to and from the null link 0.
+#define mem_pi2link(pi)		((pi) ? (uint32_t)((pi) - mem_pageinfo) : 0)
+#define mem_link2pi(link)	((link) ? &mem_pageinfo[link] : NULL)
+
 
 // The linker defines these special symbols to mark the start and end of
 // the program's entire linker-arranged memory region,
@@ -71,6 +113,14 @@ extern char start[], end[];
 // Detect available physical memory and initialize the mem_pageinfo array.
 void mem_init(void);
 
+// Return true if physical addresses [lo,hi) are all usable RAM
+// according to the boot memory map, rather than reserved or I/O space.
+bool mem_isram(uint32_t lo, uint32_t hi);
+
+// Initialize another chunk of the physical memory mem_init() left for later.
+// Called by idle CPUs; returns false once all memory is initialized.
+bool mem_init_more(void);
+
 // Allocate a physical page and return a pointer to its pageinfo struct.
 // Returns NULL if no more physical pages are available.
 pageinfo *mem_alloc(void);
@@ -78,6 +128,107 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Allocate up to n pages at once, chained through their free_next links,
+// returning the number of pages actually allocated.
+int mem_alloc_n(pageinfo **chain, int n);
+
+// Free a null-terminated chain of pages linked through free_next.
+void mem_free_n(pageinfo *head);
+
+// Allocate a page of a particular color (0 <= color < mem_ncolor),
+// or of the current CPU's next color in turn if color is MEM_COLOR_NEXT,
+// so that buffers allocated together don't compete for the same cache sets.
+// Returns NULL if no page of that color is available.
+pageinfo *mem_alloc_color(int color);
+
+// Free a page from mem_alloc_color(), keeping it on hand for reuse.
+void mem_free_color(pageinfo *pi);
+
+// Allocate a physically contiguous block of 2^order pages,
+// aligned to its size, and return the pageinfo for its first page.
+// Returns NULL if no contiguous block of that size is available.
+pageinfo *mem_alloc_order(int order);
+
+// Free a block allocated by mem_alloc_order() with the same order.
+void mem_free_order(pageinfo *pi, int order);
+
+// Print buddy allocator free-block and fragmentation statistics.
+void mem_buddy_stats(void);
+
+// Allocate a physical page that has been cleared to all zeros,
+// preferably one zeroed ahead of time by an idle CPU.
+pageinfo *mem_alloc_zeroed(void);
+
+// Zero a free page in advance for mem_alloc_zeroed(), if any are needed.
+// Called by idle CPUs; returns true if it did any work.
+bool mem_zero_idle(void);
+
+// Print pre-zeroed page pool hit and miss counts.
+void mem_zero_stats(void);
+
+// Stress-test the page allocator concurrently on all CPUs,
+// reporting throughput as the number of participating CPUs grows.
+// Must be called on every CPU once mem_init() has completed.
+void mem_check_mp(void);
+
+
+
+// Per-CPU page allocator statistics, for mem_stats_print().
+// Every operation is counted, but only one in MEM_STATS_SAMPLE
+// of each kind gets timed, so leaving the timing on costs next to nothing.
+#define MEM_STATS_SAMPLE 16		// Time one in this many operations
+#define MEM_NHIST	32		// Log2 latency histogram buckets
+
+#define MEM_OP_ALLOC	0		// Pages allocated
+#define MEM_OP_FREE	1		// Pages freed
+#define MEM_OP_INCREF	2		// mem_incref() calls
+#define MEM_OP_DECREF	3		// mem_decref() calls
+#define MEM_NOP		4
+
+typedef struct mem_cpustats {
+	uint32_t	nop[MEM_NOP];	// Operation counts
+	uint32_t	nfail;		// Allocations that found no memory
+	uint32_t	magpeak;	// Most free pages ever in our magazine
+	uint32_t	hist[MEM_NOP][MEM_NHIST]; // Cycles, log2-bucketed
+} gcc_aligned(64) mem_cpustats;
+
+PERCPU_DECLARE(mem_cpustats, mem_stats);
+
+// Switch a page that the caller holds a reference to into shared mode,
+// so that references to it no longer bounce one cache line between CPUs.
+// Returns false, leaving the page alone, if all shared slots are in use.
+bool mem_share(pageinfo *pi);
+
+// Take a page back out of shared mode, folding all CPUs' counts into
+// pi->refcount, and freeing the page with freefun if none remain.
+void mem_unshare(pageinfo *pi, void (*freefun)(pageinfo *pi));
+
+// Apply delta to a shared page's reference count on this CPU,
+// if it's still shared; returns false if the caller must do it atomically.
+bool mem_shared_add(pageinfo *pi, int delta);
+
+// Print per-CPU allocator statistics and latency histograms.
+void mem_stats_print(void);
+
+// Count an operation, and return a start timestamp if it's to be timed.
+static gcc_inline uint64_t
+mem_stats_begin(mem_cpustats *st, int op)
+{
+	return st->nop[op]++ % MEM_STATS_SAMPLE == 0 ? rdtsc() : 0;
+}
+
+// Record the latency of an operation if mem_stats_begin() timed it.
+static gcc_inline void
+mem_stats_end(mem_cpustats *st, int op, uint64_t t0)
+{
+	if (t0 == 0)
+		return;
+	uint32_t cyc = rdtsc() - t0;
+	int b = 0;
+	if (cyc != 0)
+		asm("bsrl %1,%0" : "=r" (b) : "rm" (cyc));
+	st->hist[op][b]++;
+}
 
 
 // Atomically increment the reference count on a page.
@@ -87,19 +238,65 @@ mem_incref(pageinfo *pi)
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	lockadd(&pi->refcount, 1);
+	mem_cpustats *st = &percpu(mem_stats);
+	uint64_t t0 = mem_stats_begin(st, MEM_OP_INCREF);
+	if (!(pi->flags & PI_SHARED) || !mem_shared_add(pi, 1))
+		lockadd(&pi->refcount, 1);
+	mem_stats_end(st, MEM_OP_INCREF, t0);
 }
 
 // Atomically decrement the reference count on a page,
 // freeing the page with the provided function if there are no more refs.
+// A shared page never reaches zero here: mem_unshare() must release it.
 static gcc_inline void
 mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	if (lockaddz(&pi->refcount, -1))
-			freefun(pi);
+	mem_cpustats *st = &percpu(mem_stats);
+	uint64_t t0 = mem_stats_begin(st, MEM_OP_DECREF);
+	bool last = false;
+	if (!(pi->flags & PI_SHARED) || !mem_shared_add(pi, -1))
+		last = lockaddz(&pi->refcount, -1);
+	mem_stats_end(st, MEM_OP_DECREF, t0);
+	if (last)
+		freefun(pi);
+	assert(pi->refcount >= 0);
+}
+
+// A batch of pages whose last reference has been dropped,
+// queued up to be freed all at once with mem_batch_flush().
+typedef struct mem_batch {
+	pageinfo	*head;		// Chain of pages linked through free_next
+	int		count;		// Number of pages on the chain
+} mem_batch;
+
+#define MEM_BATCH_INIT	{ NULL, 0 }
+
+// Free all the pages queued on a batch.
+void mem_batch_flush(mem_batch *b);
+
+// Like mem_decref(), but queue the page on batch b if it becomes free,
+// flushing the batch whenever it has grown large.
+static gcc_inline void
+mem_decref_batch(pageinfo *pi, mem_batch *b)
+{
+	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
+	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+
+	mem_cpustats *st = &percpu(mem_stats);
+	uint64_t t0 = mem_stats_begin(st, MEM_OP_DECREF);
+	bool last = false;
+	if (!(pi->flags & PI_SHARED) || !mem_shared_add(pi, -1))
+		last = lockaddz(&pi->refcount, -1);
+	mem_stats_end(st, MEM_OP_DECREF, t0);
+	if (last) {
+		pi->free_next = mem_pi2link(b->head);
+		b->head = pi;
+		if (++b->count >= MEM_BATCHMAX)
+			mem_batch_flush(b);
+	}
 	assert(pi->refcount >= 0);
 }
 
@@ -0,0 +1,247 @@
+/*
+ * Same-page merging: collapsing byte-identical physical pages into one.
+ * Each scan hashes every registered page, confirms hash matches with
+ * memcmp, and repoints duplicate references at a single copy,
+ * which then carries one reference per registered user.
+ * There are no page tables to write-protect merged pages with yet,
+ * so copy-on-write is up to the owner of each reference,
+ * which must call merge_cow() before storing into its page.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/cons.h>
+#include <kern/init.h>
+#include <kern/spinlock.h>
+#include <kern/merge.h>
+
+
+#define MERGE_HASHSIZE	1024		// Hash buckets; a power of two
+
+static spinlock merge_lock;		// Protects everything below
+static pageinfo **merge_ref[MERGE_MAXREF]; // Registered page references
+static int merge_nref;
+
+// Hash table of the pages seen so far in a scan, chained by index.
+static int merge_bucket[MERGE_HASHSIZE];	// First entry + 1, or 0
+static int merge_next[MERGE_MAXREF];		// Next entry + 1, or 0
+static uint32_t merge_hash[MERGE_MAXREF];
+
+static volatile bool merge_ready;		// merge_check() has finished
+static volatile uint32_t merge_scanning;	// A scan is in progress
+static uint64_t merge_lastscan;			// When the last scan began
+
+// Statistics
+static uint32_t merge_nscan;		// Scans completed
+static uint32_t merge_nmerged;		// References repointed
+static uint32_t merge_nreclaimed;	// Pages freed by merging
+static uint32_t merge_ncow;		// Copies made by merge_cow()
+static uint32_t merge_lastpages;	// Pages hashed by the last scan
+static uint32_t merge_lastreclaimed;	// Pages freed by the last scan
+static uint64_t merge_lastcycles;	// Cycles taken by the last scan
+
+void merge_check(void);
+
+
+void
+merge_init(void)
+{
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	spinlock_init(&merge_lock);
+	cons_hotkey(CONS_HOTKEY('D'), merge_stats, "page merging statistics");
+
+	merge_check();
+	merge_lastscan = rdtsc();
+	merge_ready = 1;	// Let idle CPUs start scanning
+}
+
+bool
+merge_register(pageinfo **ref)
+{
+	assert(*ref != NULL && (*ref)->refcount > 0);
+
+	spinlock_acquire(&merge_lock);
+	bool ok = merge_nref < MERGE_MAXREF;
+	if (ok)
+		merge_ref[merge_nref++] = ref;
+	spinlock_release(&merge_lock);
+	return ok;
+}
+
+void
+merge_unregister(pageinfo **ref)
+{
+	int i;
+	spinlock_acquire(&merge_lock);
+	for (i = 0; i < merge_nref && merge_ref[i] != ref; i++)
+		;
+	assert(i < merge_nref);		// must have been registered
+	merge_ref[i] = merge_ref[--merge_nref];
+	spinlock_release(&merge_lock);
+}
+
+pageinfo *
+merge_cow(pageinfo **ref)
+{
+	spinlock_acquire(&merge_lock);
+	pageinfo *pi = *ref;
+	if (pi->refcount > 1 || (pi->flags & PI_SHARED)) {
+		pageinfo *npi = mem_alloc();
+		if (npi != NULL) {
+			memmove(mem_pi2ptr(npi), mem_pi2ptr(pi), PAGESIZE);
+			mem_incref(npi);
+			*ref = npi;
+			mem_decref(pi, mem_free);
+			merge_ncow++;
+		}
+		pi = npi;
+	}
+	spinlock_release(&merge_lock);
+	return pi;
+}
+
+// FNV-1a hash of a page's contents, a word at a time.
+static uint32_t
+merge_hashpage(pageinfo *pi)
+{
+	const uint32_t *p = mem_pi2ptr(pi), *e = p + PAGESIZE/4;
+	uint32_t h = 2166136261u;
+	for (; p < e; p++)
+		h = (h ^ *p) * 16777619;
+	return h;
+}
+
+int
+merge_scan(void)
+{
+	uint64_t t0 = rdtsc();
+	int i, j, nreclaimed = 0;
+
+	spinlock_acquire(&merge_lock);
+	memset(merge_bucket, 0, sizeof(merge_bucket));
+	for (i = 0; i < merge_nref; i++) {
+		pageinfo *pi = *merge_ref[i];
+		uint32_t h = merge_hash[i] = merge_hashpage(pi);
+
+		// Look for an identical page among those already hashed.
+		for (j = merge_bucket[h & (MERGE_HASHSIZE-1)]; j != 0;
+				j = merge_next[j-1]) {
+			pageinfo *dup = *merge_ref[j-1];
+			if (merge_hash[j-1] == h && (dup == pi
+					|| memcmp(mem_pi2ptr(dup),
+						mem_pi2ptr(pi), PAGESIZE) == 0))
+				break;
+		}
+		if (j == 0) {		// first of its kind: remember it
+			merge_next[i] = merge_bucket[h & (MERGE_HASHSIZE-1)];
+			merge_bucket[h & (MERGE_HASHSIZE-1)] = i+1;
+			continue;
+		}
+
+		pageinfo *dup = *merge_ref[j-1];
+		if (dup == pi)		// already merged
+			continue;
+		mem_incref(dup);
+		*merge_ref[i] = dup;
+		merge_nmerged++;
+		if (pi->refcount == 1 && !(pi->flags & PI_SHARED))
+			nreclaimed++;	// we hold the last reference
+		mem_decref(pi, mem_free);
+	}
+	merge_nscan++;
+	merge_nreclaimed += nreclaimed;
+	merge_lastpages = merge_nref;
+	merge_lastreclaimed = nreclaimed;
+	merge_lastcycles = rdtsc() - t0;
+	spinlock_release(&merge_lock);
+
+	return nreclaimed;
+}
+
+bool
+merge_idle(void)
+{
+	if (!merge_ready || rdtsc() - merge_lastscan < MERGE_PERIOD
+			|| xchg(&merge_scanning, 1) != 0)
+		return false;
+	merge_lastscan = rdtsc();
+	merge_scan();
+	merge_scanning = 0;
+	return true;
+}
+
+void
+merge_stats(void)
+{
+	cprintf("merge_stats: %d pages registered, %u scans, "
+		"%u merged, %u reclaimed, %u copied on write\n",
+		merge_nref, merge_nscan, merge_nmerged, merge_nreclaimed,
+		merge_ncow);
+	cprintf("merge_stats: last scan: %u pages, %u reclaimed, "
+		"%llu cycles\n", merge_lastpages, merge_lastreclaimed,
+		merge_lastcycles);
+}
+
+
+void
+merge_check(void)
+{
+	static pageinfo *pg[8];
+	int i;
+
+	// Keep idle CPUs' scans from repointing our references mid-check,
+	// and from changing the page counts the asserts below expect.
+	while (xchg(&merge_scanning, 1) != 0)
+		pause();
+
+	// Pages 0-3 are zero-filled, 4-5 share a pattern, 6-7 are unique.
+	for (i = 0; i < 8; i++) {
+		pg[i] = mem_alloc();
+		assert(pg[i] != NULL);
+		mem_incref(pg[i]);
+		memset(mem_pi2ptr(pg[i]), i < 4 ? 0 : i < 6 ? 0x5a : i,
+			PAGESIZE);
+		assert(merge_register(&pg[i]));
+	}
+	((uint8_t *) mem_pi2ptr(pg[7]))[0] = 6;	// still unlike page 6
+
+	assert(merge_scan() == 4);
+	assert(pg[1] == pg[0] && pg[2] == pg[0] && pg[3] == pg[0]);
+	assert(pg[0]->refcount == 4);
+	assert(pg[5] == pg[4] && pg[4]->refcount == 2);
+	assert(pg[6] != pg[7] && pg[6] != pg[4] && pg[6]->refcount == 1);
+
+	// A second scan should find nothing more to do.
+	assert(merge_scan() == 0);
+
+	// Writing gets a private copy, leaving the others with the original.
+	pageinfo *old = pg[2];
+	assert(merge_cow(&pg[2]) != old && pg[2] != old);
+	assert(old->refcount == 3 && pg[2]->refcount == 1);
+	((uint8_t *) mem_pi2ptr(pg[2]))[0] = 1;
+	assert(((uint8_t *) mem_pi2ptr(pg[0]))[0] == 0);
+	assert(merge_cow(&pg[6]) == pg[6]);	// unshared: no copy needed
+
+	for (i = 0; i < 8; i++) {
+		merge_unregister(&pg[i]);
+		mem_decref(pg[i], mem_free);
+	}
+	assert(merge_nref == 0);
+	merge_scanning = 0;
+
+	if (boot_option("bench"))
+		merge_stats();
+	cprintf("merge_check() succeeded!\n");
+}
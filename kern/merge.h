@@ -0,0 +1,60 @@
+/*
+ * Same-page merging: collapsing byte-identical physical pages into one.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_MERGE_H
+#define PIOS_KERN_MERGE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/mem.h>
+
+
+// Most page references that can be registered for merging at once.
+#define MERGE_MAXREF	1024
+
+// Minimum cycles between background scans started by merge_idle().
+#define MERGE_PERIOD	((uint64_t)1 << 30)
+
+
+// Set up page merging and check that it works.
+void merge_init(void);
+
+// Register a variable holding a counted reference to a page,
+// allowing the merger to repoint it at an identical page at any time
+// (dropping the old reference and taking one on the new page).
+// Returns false if the registry is full.
+// Until the reference is unregistered, its page must be treated as
+// read-only except through merge_cow().
+bool merge_register(pageinfo **ref);
+
+// Remove a page reference from the registry.
+void merge_unregister(pageinfo **ref);
+
+// Prepare to store into the page *ref refers to:
+// if the page is shared, with the merger or anyone else,
+// replace *ref with a reference to a private copy of it.
+// Returns the page *ref now refers to, or NULL if out of memory.
+pageinfo *merge_cow(pageinfo **ref);
+
+// Scan all registered pages once, merging any duplicates found.
+// Returns the number of pages reclaimed.
+int merge_scan(void);
+
+// Run a merge scan if one is due; called by idle CPUs.
+// Returns true if it did any work.
+bool merge_idle(void);
+
+// Print merge scan statistics.
+void merge_stats(void);
+
+
+#endif /* !PIOS_KERN_MERGE_H */
@@ -0,0 +1,173 @@
+/*
+ * Multiprocessor bootstrap: finding the other processors in the system.
+ * See MultiProcessor Specification Version 1.[14].
+ *
+ * Copyright (c) 2006-2009 Frans Kaashoek, Robert Morris, Russ Cox,
+ *                         Massachusetts Institute of Technology
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Derived from xv6.
+ * Adapted for PIOS by Bryan Ford at Yale University.
+ */
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/mp.h>
+#include <kern/acpi.h>
+
+#include <dev/lapic.h>
+
+
+bool mp_ismp;
+uint8_t mp_ioapicid;
+volatile uint32_t *mp_ioapic;
+
+
+static uint8_t
+sum(uint8_t * addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += addr[i];
+	return sum;
+}
+
+// Look for an MP structure in the len bytes at physical address addr.
+static struct mp *
+mpsearch1(uint32_t addr, int len)
+{
+	uint8_t *e, *p;
+
+	e = mem_ptr(addr + len);
+	for (p = mem_ptr(addr); p < e; p += sizeof(struct mp))
+		if (memcmp(p, "_MP_", 4) == 0 && sum(p, sizeof(struct mp)) == 0)
+			return (struct mp *) p;
+	return 0;
+}
+
+// Search for the MP Floating Pointer Structure, which according to the
+// spec is in one of the following three locations:
+// 1) in the first KB of the EBDA;
+// 2) in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xF0000 and 0xFFFFF.
+static struct mp *
+mpsearch(void)
+{
+	uint8_t *bda;
+	uint32_t p;
+	struct mp *mp;
+
+	bda = mem_ptr(0x400);
+	if ((p = ((bda[0x0F] << 8) | bda[0x0E]) << 4)) {
+		if ((mp = mpsearch1(p, 1024)))
+			return mp;
+	} else {
+		p = ((bda[0x14] << 8) | bda[0x13]) * 1024;
+		if ((mp = mpsearch1(p - 1024, 1024)))
+			return mp;
+	}
+	return mpsearch1(0xF0000, 0x10000);
+}
+
+// Search for an MP configuration table.  For now,
+// don't accept the default configurations (physaddr == 0).
+// Check for correct signature, calculate the checksum and,
+// if correct, check the version.
+// To do: check extended table checksum.
+static struct mpconf *
+mpconfig(struct mp **pmp) {
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = mpsearch()) == 0 || mp->physaddr == 0)
+		return 0;
+	conf = (struct mpconf *) mp->physaddr;
+	if (memcmp(conf, "PCMP", 4) != 0)
+		return 0;
+	if (conf->version != 1 && conf->version != 4)
+		return 0;
+	if (sum((uint8_t *) conf, conf->length) != 0)
+		return 0;
+	*pmp = mp;
+	return conf;
+}
+
+void
+mp_init(void)
+{
+	uint8_t *p, *e;
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	struct mpioapic *mpio;
+	int ncpu = 1, nskip = 0;
+
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	// Prefer the ACPI tables, which list every processor,
+	// falling back on the MP tables on older machines without them.
+	if (acpi_init())
+		return;
+
+	if ((conf = mpconfig(&mp)) == 0)
+		return; // Not a multiprocessor machine - just use boot CPU.
+
+	mp_ismp = 1;
+	lapic = (uint32_t *) conf->lapicaddr;
+	for (p = conf->entries, e = (uint8_t *) conf + conf->length; p < e; ) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *) p;
+			p += sizeof(struct mpproc);
+			if (!(proc->flags & MPENAB))
+				continue;	// processor disabled
+
+			// Get a cpu struct and kernel stack for each non-boot CPU.
+			// Which one an AP actually gets is up to it:
+			// see boot/bootother.S.
+			if (proc->flags & MPBOOT)
+				continue;
+			if (ncpu >= CPU_MAX) {
+				nskip++;
+				continue;
+			}
+			cpu_alloc();
+			ncpu++;
+			continue;
+		case MPIOAPIC:
+			mpio = (struct mpioapic *) p;
+			p += sizeof(struct mpioapic);
+			if (mp_ioapic == NULL) {
+				mp_ioapicid = mpio->apicno;
+				mp_ioapic = (volatile uint32_t *) mpio->addr;
+			}
+			continue;
+		case MPBUS:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			panic("mp_init: unknown config type %x\n", *p);
+		}
+	}
+	if (nskip > 0)
+		warn("mp_init: ignoring %d CPUs beyond CPU_MAX (%d)",
+			nskip, CPU_MAX);
+
+	if (mp->imcrp) {
+		// Bochs doesn't support IMCR, so this doesn't run on Bochs.
+		// But it would on real hardware.
+		outb(0x22, 0x70);		// Select IMCR
+		outb(0x23, inb(0x23) | 1);	// Mask external interrupts.
+	}
+}
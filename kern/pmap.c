@@ -0,0 +1,187 @@
+/*
+ * Kernel page table management.
+ * For now the kernel just identity-maps the whole physical address space,
+ * using 4MB "superpages" (PSE) marked global (PGE),
+ * so the map itself costs only one page directory,
+ * and its TLB entries cover 1024 times as much memory as 4KB mappings
+ * and survive CR3 reloads.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/init.h>
+#include <kern/pmap.h>
+
+
+uint32_t pmap_bootpdir[NPDENTRIES] gcc_aligned(PAGESIZE);
+
+static bool pmap_pge;		// Processor supports global pages
+
+void pmap_check(void);
+
+
+void
+pmap_init(void)
+{
+	cpuinfo inf;
+	cpuid(1, &inf);
+	if (!(inf.edx & CPUID_EDX_PSE))
+		panic("pmap_init: processor lacks 4MB page support");
+
+	if (cpu_onboot()) {
+		pmap_pge = (inf.edx & CPUID_EDX_PGE) != 0;
+
+		// Identity-map all 4GB with 4MB pages.
+		// user() still runs kernel code in ring 3, so everything
+		// is user-accessible for now.  Anything above the top of RAM
+		// is memory-mapped I/O (e.g., the local APIC), so don't cache it.
+		uint32_t pg = PTE_P | PTE_W | PTE_U | PTE_PS
+				| (pmap_pge ? PTE_G : 0);
+		int i;
+		for (i = 0; i < NPDENTRIES; i++) {
+			uint32_t pa = i * PTSIZE;
+			pmap_bootpdir[i] = pa | pg;
+			if (pa >= mem_max)
+				pmap_bootpdir[i] |= PTE_PCD | PTE_PWT;
+		}
+	}
+
+	// Turn on paging.  Page size extensions must be on before
+	// we load a page directory containing 4MB pages,
+	// and global pages are best enabled after paging itself.
+	lcr4(rcr4() | CR4_PSE);
+	lcr3(mem_phys(pmap_bootpdir));
+	lcr0(rcr0() | CR0_PE | CR0_PG | CR0_WP);
+	if (pmap_pge)
+		lcr4(rcr4() | CR4_PGE);
+
+	if (cpu_onboot())
+		pmap_check();
+}
+
+// Flush the entire TLB, including global entries.
+static void
+pmap_flushall(void)
+{
+	uint32_t cr4 = rcr4();
+	lcr4(cr4 & ~CR4_PGE);
+	lcr4(cr4);
+}
+
+// Time nread reads of the first word of randomly chosen objects
+// among n objects of size sz starting at base,
+// starting with a cold TLB and returning the average cycles per read.
+static uint32_t
+pmap_walk(void *base, uint32_t n, uint32_t sz, int nread)
+{
+	static volatile uint32_t sink;
+	uint32_t x = 12345, sum = 0;
+	int i;
+
+	pmap_flushall();
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < nread; i++) {
+		x = x * 1103515245 + 12345;	// LCG; use the better high bits
+		sum += *(volatile uint32_t*)(base + (x >> 8) % n * sz);
+	}
+	uint64_t cyc = rdtsc() - t0;
+	sink = sum;
+	return cyc / nread;
+}
+
+//
+// Check that the identity map works, and if "bench" is on the command line,
+// measure what the 4MB pages buy us: build an equivalent map
+// from ordinary 4KB pages, then time random walks over mem_pageinfo
+// and over the largest stretch of RAM under each map.
+// Such walks miss in the TLB on nearly every access
+// once the memory walked exceeds the TLB's reach.
+//
+void
+pmap_check(void)
+{
+	// We're still running with paging on, so the identity map works.
+	assert(rcr0() & CR0_PG);
+	assert(rcr3() == mem_phys(pmap_bootpdir));
+	assert(*(uint32_t *) mem_ptr(mem_phys(&pmap_pge)) == pmap_pge);
+
+	if (!boot_option("bench")) {
+		cprintf("pmap_check() succeeded!\n");
+		return;
+	}
+
+	// Find the longest run of whole 4MB pages of RAM to walk,
+	// since reading from device memory in the holes could do anything.
+	uint32_t top = ROUNDDOWN(mem_max, PTSIZE);
+	uint32_t walklo = 0, walkhi = 0, lo, hi;
+	for (lo = PTSIZE; lo < top; lo = hi + PTSIZE) {
+		for (hi = lo; hi < top && mem_isram(hi, hi + PTSIZE); )
+			hi += PTSIZE;
+		if (hi - lo > walkhi - walklo) {
+			walklo = lo;
+			walkhi = hi;
+		}
+		if (hi == top)
+			break;
+	}
+	assert(walkhi > walklo);
+
+	// Build a 4KB-page map of RAM, sharing the 4MB I/O mappings above it,
+	// and not caching any holes in RAM below it.
+	pageinfo *pdpi = mem_alloc_zeroed();
+	assert(pdpi != NULL);
+	uint32_t *pdir = mem_pi2ptr(pdpi);
+	uint32_t ntab = ROUNDUP(mem_max, PTSIZE) / PTSIZE;
+	int i, j;
+	for (i = 0; i < NPDENTRIES; i++) {
+		if (i >= ntab) {
+			pdir[i] = pmap_bootpdir[i];
+			continue;
+		}
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		uint32_t *pt = mem_pi2ptr(pi);
+		for (j = 0; j < NPTENTRIES; j++) {
+			uint32_t pa = i * PTSIZE + j * PAGESIZE;
+			pt[j] = pa | PTE_P | PTE_W | PTE_U;
+			if (!mem_isram(pa, pa + PAGESIZE))
+				pt[j] |= PTE_PCD | PTE_PWT;
+		}
+		pdir[i] = mem_pi2phys(pi) | PTE_P | PTE_W | PTE_U;
+	}
+
+	// Walk mem_pageinfo, and then one word per page of that RAM.
+	const int nread = 1000000;
+	uint32_t npg = (walkhi - walklo) / PAGESIZE;
+	lcr3(mem_pi2phys(pdpi));
+	uint32_t pi4k = pmap_walk(mem_pageinfo, mem_npage,
+					sizeof(pageinfo), nread);
+	uint32_t pg4k = pmap_walk(mem_ptr(walklo), npg, PAGESIZE, nread);
+	lcr3(mem_phys(pmap_bootpdir));
+	pmap_flushall();	// don't leave stale 4KB entries around
+	uint32_t pi4m = pmap_walk(mem_pageinfo, mem_npage,
+					sizeof(pageinfo), nread);
+	uint32_t pg4m = pmap_walk(mem_ptr(walklo), npg, PAGESIZE, nread);
+
+	cprintf("pmap_check: pageinfo walk: %u cycles/read with 4KB pages, "
+		"%u with 4MB pages\n", pi4k, pi4m);
+	cprintf("pmap_check: page walk: %u cycles/read with 4KB pages, "
+		"%u with 4MB pages\n", pg4k, pg4m);
+
+	for (i = 0; i < ntab; i++)
+		mem_free(mem_phys2pi(PGADDR(pdir[i])));
+	mem_free(pdpi);
+
+	cprintf("pmap_check() succeeded!\n");
+}
@@ -0,0 +1,31 @@
+/*
+ * Kernel page table management.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_PMAP_H
+#define PIOS_KERN_PMAP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+
+// Page directory identity-mapping all 4GB of the physical address space,
+// which the kernel relies on for mem_ptr() and mem_phys() to be no-ops.
+extern uint32_t pmap_bootpdir[NPDENTRIES];
+
+
+// Set up the identity map on the boot CPU, check it,
+// and enable paging with it on the current CPU.
+// Must be called on every CPU, after mem_init().
+void pmap_init(void);
+
+
+#endif /* !PIOS_KERN_PMAP_H */
@@ -0,0 +1,146 @@
+/*
+ * Statistical sampling profiler driven by the local APIC timer.
+ * While sampling, each CPU's timer interrupts it PROF_HZ times a second,
+ * and the interrupt handler records the interrupted EIP, privilege level,
+ * and kernel call chain into that CPU's ring of the last PROF_NSAMPLE samples.
+ * prof_dump() prints the samples over the console as lines of the form:
+ *
+ *	prof: cpu=N cpl=L EIP CALLER CALLER...
+ *
+ * bracketed by "prof: begin" and "prof: end" lines.
+ * The kernel has no symbol table of its own, so misc/prof-fold.pl
+ * symbolizes them against obj/kern/kernel.sym afterwards,
+ * and folds them into one line per distinct stack for flame graphs.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/trap.h>
+#include <kern/cons.h>
+#include <kern/init.h>
+#include <kern/prof.h>
+
+#include <dev/lapic.h>
+
+
+// I/O ports of the two 8259A interrupt controllers' mask registers.
+#define IO_PIC1_MASK	0x21
+#define IO_PIC2_MASK	0xa1
+
+static bool prof_on;			// "prof" is on the command line
+
+// Each CPU's ring of samples, and the number of samples it has ever taken.
+static PERCPU_DEFINE(prof_sample, prof_ring[PROF_NSAMPLE]);
+static PERCPU_DEFINE(uint32_t, prof_nsample);
+
+
+// Timer interrupt handler: take a sample.
+// Runs via trap_direct() in the middle of arbitrary kernel code,
+// so it must touch nothing but this CPU's ring and its local APIC.
+// Follows the same %ebp chain as debug_trace(), but only within this CPU's
+// kernel stack, since interrupted code might have %ebp in mid-update.
+static void
+prof_intr(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+	prof_sample *s = &percpu_on(c, prof_ring)[
+				percpu_on(c, prof_nsample)++ % PROF_NSAMPLE];
+	s->eip[0] = tf->eip;
+	s->cpl = tf->cs & 3;
+	s->cpu = c->id;
+
+	int d = 1;
+	uint32_t ebp = tf->regs.ebp;
+	while (s->cpl == 0 && d < PROF_DEPTH && (ebp & 3) == 0
+			&& ebp >= (uint32_t) c->kstacklo
+			&& ebp + 8 <= (uint32_t) c->kstackhi) {
+		uint32_t *frame = (uint32_t *) ebp;
+		s->eip[d++] = frame[1];
+		ebp = frame[0];
+	}
+	s->depth = d;
+
+	lapic_eoi();
+}
+
+void
+prof_init(void)
+{
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	cons_hotkey(CONS_HOTKEY('F'), prof_dump,
+			"profiler samples, for misc/prof-fold.pl");
+	if (!boot_option("prof"))
+		return;
+	if (!lapic) {
+		warn("prof_init: no local APIC timer to sample with");
+		return;
+	}
+
+	// We don't use the 8259As yet, and the BIOS may have left the PIT
+	// ticking into one on vector 8, so mask them before enabling interrupts.
+	outb(IO_PIC1_MASK, 0xff);
+	outb(IO_PIC2_MASK, 0xff);
+
+	trap_register(T_LTIMER, prof_intr);
+	prof_on = 1;
+}
+
+void
+prof_start(void)
+{
+	if (!prof_on)
+		return;
+	lapic_timer(PROF_HZ);
+	sti();
+}
+
+void
+prof_stop(void)
+{
+	if (!prof_on)
+		return;
+	cli();
+	lapic_timer(0);
+
+	if (cpu_onboot())
+		prof_dump();
+}
+
+// Print every CPU's samples, oldest first.
+// Reads other CPUs' rings without synchronization,
+// so a CPU still sampling may garble a line, but never unsafely.
+void
+prof_dump(void)
+{
+	uint32_t total = 0, dropped = 0;
+	cpu *c;
+	uint32_t i;
+	int d;
+
+	cprintf("prof: begin hz=%d\n", PROF_HZ);
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		uint32_t n = percpu_on(c, prof_nsample);
+		uint32_t first = n > PROF_NSAMPLE ? n - PROF_NSAMPLE : 0;
+		for (i = first; i < n; i++) {
+			prof_sample *s = &percpu_on(c, prof_ring)[
+							i % PROF_NSAMPLE];
+			cprintf("prof: cpu=%d cpl=%d", s->cpu, s->cpl);
+			for (d = 0; d < s->depth && d < PROF_DEPTH; d++)
+				cprintf(" %08x", s->eip[d]);
+			cprintf("\n");
+		}
+		total += n;
+		dropped += first;
+	}
+	cprintf("prof: end samples=%u dropped=%u\n", total, dropped);
+}
@@ -0,0 +1,48 @@
+/*
+ * Statistical sampling profiler driven by the local APIC timer.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_PROF_H
+#define PIOS_KERN_PROF_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+#define PROF_HZ		1000		// Samples per second per CPU
+#define PROF_NSAMPLE	512		// Samples each CPU's ring buffer holds
+#define PROF_DEPTH	8		// Most EIPs recorded per sample
+
+// One sample: where the timer interrupted, and the call chain leading there.
+typedef struct prof_sample {
+	uint32_t	eip[PROF_DEPTH];	// Interrupted EIP, then callers
+	uint8_t		cpl;			// Privilege level interrupted
+	uint8_t		cpu;			// ID of the CPU sampled
+	uint16_t	depth;			// Entries of eip[] in use
+} prof_sample;
+
+// Set up the profiler on this CPU.  Called on every CPU after lapic_init().
+void prof_init(void);
+
+// Start or stop sampling on this CPU, if "prof" is on the boot command line.
+// Sampling needs interrupts, so this CPU runs with them enabled in between.
+// The kernel otherwise assumes interrupts are off, e.g., for the per-CPU
+// page magazines and slab caches, so the timer is the only interrupt
+// we unmask, and its handler enters through trap_direct(), bypassing
+// trap(), and touches nothing but this CPU's sample ring and local APIC.
+// On the boot CPU, prof_stop() also prints all CPUs' samples.
+void prof_start(void);
+void prof_stop(void);
+
+// Print all CPUs' samples for misc/prof-fold.pl to turn into folded stacks.
+void prof_dump(void);
+
+
+#endif /* !PIOS_KERN_PROF_H */
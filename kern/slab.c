@@ -0,0 +1,374 @@
+/*
+ * Slab allocator for small kernel objects, layered on mem_alloc().
+ * Loosely follows Bonwick's design for the SunOS 5.4 kernel:
+ * each cache owns a set of single-page slabs of equal-sized objects,
+ * and a small per-CPU stack of free objects in front of the slabs
+ * lets most allocations and frees run without taking the cache's lock.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/slab.h>
+#include <kern/cons.h>
+#include <kern/init.h>
+
+
+// Header at the start of every slab page.
+// Free objects are tracked by index in freeidx[],
+// rather than with links stored in the objects themselves,
+// so that free objects keep the state their constructor gave them.
+typedef struct slab {
+	slab_cache	*cache;		// Cache this slab belongs to
+	struct slab	*next;		// Links on one of the cache's lists
+	struct slab	*prev;
+	int		nfree;		// Number of entries in freeidx[]
+	uint8_t		freeidx[0];	// Stack of free object indexes
+} slab;
+
+#define SLAB_MAXOBJ	256		// Object indexes must fit in a uint8_t
+
+
+static slab_cache *slab_caches;		// List of all caches
+static int slab_ncache;			// Number of caches on the list
+static spinlock slab_cacheslock;	// Protects slab_caches, slab_ncache
+
+// Each CPU's own caches of free objects, indexed by slab_cache.idx.
+// Only their own CPU touches them, with interrupts disabled,
+// or enabled only for the profiling timer, which never calls us.
+static PERCPU_DEFINE(slab_cpucache, slab_cpu[SLAB_MAXCACHE]);
+
+// Size classes for kmalloc(), from KMALLOC_MIN to KMALLOC_MAX bytes.
+#define KMALLOC_NCLASS	8
+static slab_cache kmalloc_cache[KMALLOC_NCLASS];
+static const char *kmalloc_name[KMALLOC_NCLASS] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+void slab_check(void);
+
+
+void
+slab_init(void)
+{
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	spinlock_init(&slab_cacheslock);
+
+	int i;
+	for (i = 0; i < KMALLOC_NCLASS; i++)
+		slab_cache_init(&kmalloc_cache[i], kmalloc_name[i],
+				KMALLOC_MIN << i, 0, NULL);
+	static_assert(KMALLOC_MIN << (KMALLOC_NCLASS-1) == KMALLOC_MAX);
+
+	cons_hotkey(CONS_HOTKEY('K'), slab_print, "slab cache statistics");
+
+	slab_check();
+}
+
+void
+slab_cache_init(slab_cache *sc, const char *name, size_t size,
+		size_t align, void (*ctor)(void *obj))
+{
+	// Objects smaller than a cache line get padded to a power of two,
+	// so that they pack evenly into lines; larger ones to whole lines.
+	align = MAX(align, sizeof(void*));
+	assert((align & (align-1)) == 0);
+	size = ROUNDUP(MAX(size, 1), align);
+	if (size < SLAB_LINESIZE)
+		while (SLAB_LINESIZE % size != 0)
+			size += align;
+	else
+		size = ROUNDUP(size, SLAB_LINESIZE);
+
+	// Fit as many objects as we can after the header and free index stack,
+	// starting the objects on a cache line boundary.
+	int n = MIN((PAGESIZE - sizeof(slab)) / size, SLAB_MAXOBJ);
+	while (n > 0 && ROUNDUP(sizeof(slab) + n, SLAB_LINESIZE) + n * size
+			> PAGESIZE)
+		n--;
+	if (n == 0)
+		panic("slab_cache_init: %s objects too large (%d bytes)",
+			name, (int)size);
+
+	// Our lock goes on the global list of locks, and our per-CPU caches
+	// are never reused, so zeroing a live cache would corrupt both.
+	spinlock_acquire(&slab_cacheslock);
+	slab_cache *c;
+	for (c = slab_caches; c != NULL; c = c->next)
+		if (c == sc)
+			panic("slab_cache_init: %s already initialized", name);
+	if (slab_ncache == SLAB_MAXCACHE)
+		panic("slab_cache_init: too many caches for %s", name);
+
+	memset(sc, 0, sizeof(*sc));
+	sc->name = name;
+	sc->size = size;
+	sc->ctor = ctor;
+	sc->perslab = n;
+	sc->offset = ROUNDUP(sizeof(slab) + n, SLAB_LINESIZE);
+	spinlock_init(&sc->lock);
+
+	sc->idx = slab_ncache++;
+	sc->next = slab_caches;
+	slab_caches = sc;
+	spinlock_release(&slab_cacheslock);
+}
+
+// Add slab s to the head of the list *head.
+static void
+slab_link(slab **head, slab *s)
+{
+	s->prev = NULL;
+	s->next = *head;
+	if (*head != NULL)
+		(*head)->prev = s;
+	*head = s;
+}
+
+// Remove slab s from the list *head.
+static void
+slab_unlink(slab **head, slab *s)
+{
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		*head = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+}
+
+// Allocate and set up a new slab for cache sc, with all objects free.
+// Called with sc->lock held.
+static slab *
+slab_grow(slab_cache *sc)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return NULL;
+
+	slab *s = mem_pi2ptr(pi);
+	s->cache = sc;
+	s->nfree = sc->perslab;
+	int i;
+	for (i = 0; i < sc->perslab; i++) {
+		s->freeidx[i] = sc->perslab-1 - i;	// hand out in order
+		if (sc->ctor)
+			sc->ctor((void*)s + sc->offset + i * sc->size);
+	}
+	sc->nslab++;
+	sc->ngrow++;
+	return s;
+}
+
+// Move up to n objects from the cache's slabs into the per-CPU cache cc.
+static void
+slab_refill(slab_cache *sc, slab_cpucache *cc, int n)
+{
+	spinlock_acquire(&sc->lock);
+	while (n > 0) {
+		slab *s = sc->partial;
+		if (s == NULL) {
+			s = sc->empty;
+			if (s != NULL)
+				sc->empty = NULL;
+			else if ((s = slab_grow(sc)) == NULL)
+				break;
+			slab_link(&sc->partial, s);
+		}
+		for (; n > 0 && s->nfree > 0; n--)
+			cc->obj[cc->n++] = (void*)s + sc->offset
+					+ s->freeidx[--s->nfree] * sc->size;
+		if (s->nfree == 0) {
+			slab_unlink(&sc->partial, s);
+			slab_link(&sc->full, s);
+		}
+	}
+	spinlock_release(&sc->lock);
+}
+
+// Return the n objects on top of per-CPU cache cc to their slabs,
+// keeping at most one wholly free slab and giving the rest back to mem.
+static void
+slab_drain(slab_cache *sc, slab_cpucache *cc, int n)
+{
+	spinlock_acquire(&sc->lock);
+	for (; n > 0; n--) {
+		void *obj = cc->obj[--cc->n];
+		slab *s = ROUNDDOWN(obj, PAGESIZE);
+		int idx = (obj - (void*)s - sc->offset) / sc->size;
+		assert(s->cache == sc);
+		assert(obj == (void*)s + sc->offset + idx * sc->size);
+
+		if (s->nfree == 0) {
+			slab_unlink(&sc->full, s);
+			slab_link(&sc->partial, s);
+		}
+		assert(s->nfree < sc->perslab);
+		s->freeidx[s->nfree++] = idx;
+		if (s->nfree < sc->perslab)
+			continue;
+
+		slab_unlink(&sc->partial, s);
+		if (sc->empty == NULL) {
+			sc->empty = s;
+			continue;
+		}
+		s->cache = NULL;
+		mem_free(mem_ptr2pi(s));
+		sc->nslab--;
+		sc->nshrink++;
+	}
+	spinlock_release(&sc->lock);
+}
+
+void *
+slab_alloc(slab_cache *sc)
+{
+	slab_cpucache *cc = &percpu(slab_cpu)[sc->idx];
+	if (cc->n > 0)
+		cc->nhit++;
+	else {
+		slab_refill(sc, cc, SLAB_CPUBATCH);
+		if (cc->n == 0)
+			return NULL;
+	}
+	cc->nalloc++;
+	return cc->obj[--cc->n];
+}
+
+void
+slab_free(slab_cache *sc, void *obj)
+{
+	assert(((slab*)ROUNDDOWN(obj, PAGESIZE))->cache == sc);
+
+	slab_cpucache *cc = &percpu(slab_cpu)[sc->idx];
+	if (cc->n == SLAB_CPUMAX)
+		slab_drain(sc, cc, SLAB_CPUBATCH);
+	cc->obj[cc->n++] = obj;
+	cc->nfree++;
+}
+
+void *
+kmalloc(size_t size)
+{
+	assert(size <= KMALLOC_MAX);
+	int i = 0;
+	while ((KMALLOC_MIN << i) < size)
+		i++;
+	return slab_alloc(&kmalloc_cache[i]);
+}
+
+void
+kfree(void *ptr)
+{
+	slab *s = ROUNDDOWN(ptr, PAGESIZE);
+	assert(s->cache >= &kmalloc_cache[0]
+		&& s->cache < &kmalloc_cache[KMALLOC_NCLASS]);
+	slab_free(s->cache, ptr);
+}
+
+void
+slab_print(void)
+{
+	cprintf("%-14s %5s %5s %5s %8s %8s %8s %5s\n", "cache", "size",
+		"slabs", "inuse", "allocs", "frees", "cpuhits", "grow");
+	spinlock_acquire(&slab_cacheslock);
+	slab_cache *sc;
+	for (sc = slab_caches; sc != NULL; sc = sc->next) {
+		uint32_t nalloc = 0, nfree = 0, nhit = 0;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			slab_cpucache *cc = &percpu_on(c, slab_cpu)[sc->idx];
+			nalloc += cc->nalloc;
+			nfree += cc->nfree;
+			nhit += cc->nhit;
+		}
+		cprintf("%-14s %5d %5d %5d %8d %8d %8d %5d\n", sc->name,
+			(int)sc->size, sc->nslab, nalloc - nfree,
+			nalloc, nfree, nhit, sc->ngrow);
+	}
+	spinlock_release(&slab_cacheslock);
+}
+
+
+static int slab_check_nctor;
+
+static void
+slab_check_ctor(void *obj)
+{
+	*(uint32_t*)obj = 0xc0ffee;
+	slab_check_nctor++;
+}
+
+void
+slab_check(void)
+{
+	static slab_cache sc;
+	static void *obj[1000];
+	int i, j;
+
+	// Allocate a range of sizes and check each block's alignment,
+	// and that blocks of the same size class never overlap.
+	for (i = 0; i < 1000; i++) {
+		size_t size = 1 + (i * 37) % KMALLOC_MAX;
+		obj[i] = kmalloc(size);
+		assert(obj[i] != NULL);
+		assert((uint32_t)obj[i] % (size > 32 ? SLAB_LINESIZE
+						: KMALLOC_MIN) == 0);
+		memset(obj[i], i, size);
+	}
+	for (i = 0; i < 1000; i++) {
+		size_t size = 1 + (i * 37) % KMALLOC_MAX;
+		for (j = 0; j < size; j++)
+			assert(((uint8_t*)obj[i])[j] == (uint8_t)i);
+	}
+	for (i = 0; i < 1000; i++)
+		kfree(obj[i]);
+
+	// Freed blocks should be reused before any new slab is allocated.
+	uint32_t ngrow = kmalloc_cache[2].ngrow;
+	for (i = 0; i < 100; i++)
+		obj[i] = kmalloc(64);
+	for (i = 0; i < 100; i++)
+		kfree(obj[i]);
+	assert(kmalloc_cache[2].ngrow == ngrow);
+
+	// Objects of odd sizes still shouldn't straddle cache lines,
+	// and the constructor should run exactly once per object.
+	slab_cache_init(&sc, "slab_check", 24, 0, slab_check_ctor);
+	assert(sc.size == 32);
+	for (i = 0; i < 1000; i++) {
+		obj[i] = slab_alloc(&sc);
+		assert(*(uint32_t*)obj[i] == 0xc0ffee);
+		assert((uint32_t)obj[i] / SLAB_LINESIZE
+			== ((uint32_t)obj[i] + sc.size-1) / SLAB_LINESIZE);
+	}
+	assert(slab_check_nctor == sc.nslab * sc.perslab);
+	for (i = 0; i < 1000; i++)
+		slab_free(&sc, obj[i]);
+	obj[0] = slab_alloc(&sc);
+	assert(*(uint32_t*)obj[0] == 0xc0ffee);
+	slab_free(&sc, obj[0]);
+
+	// Once everything is drained from the per-CPU cache,
+	// all but one of the now-empty slabs should go back to mem.
+	slab_cpucache *cc = &percpu(slab_cpu)[sc.idx];
+	slab_drain(&sc, cc, cc->n);
+	assert(sc.nslab == 1 && sc.empty != NULL);
+	assert(sc.partial == NULL && sc.full == NULL);
+
+	if (boot_option("bench"))
+		slab_print();
+	cprintf("slab_check() succeeded!\n");
+}
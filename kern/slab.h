@@ -0,0 +1,96 @@
+/*
+ * Slab allocator for small kernel objects, layered on mem_alloc().
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_SLAB_H
+#define PIOS_KERN_SLAB_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+
+// Objects are carved out of single-page slabs,
+// each starting with a struct slab header.
+// The first object in each slab starts on a cache line boundary,
+// and objects at least a cache line long are padded to whole cache lines,
+// so no small object ever straddles two lines unnecessarily.
+#define SLAB_LINESIZE	64		// Cache line size we align to
+#define SLAB_CPUMAX	16		// Max objects in a per-CPU cache
+#define SLAB_CPUBATCH	(SLAB_CPUMAX/2)	// Objects moved per refill/drain
+#define SLAB_MAXCACHE	32		// Most caches there can be
+
+struct slab;
+
+// Per-CPU cache of free objects, touched only by its own CPU.
+// Each CPU has one for every slab cache, in a per-CPU array (see slab.c).
+typedef struct slab_cpucache {
+	int		n;		// Number of objects in obj[]
+	void		*obj[SLAB_CPUMAX];
+
+	// Usage statistics for this CPU
+	uint32_t	nalloc;		// Objects allocated
+	uint32_t	nfree;		// Objects freed
+	uint32_t	nhit;		// Allocs served without taking the lock
+} gcc_aligned(SLAB_LINESIZE) slab_cpucache;
+
+// A cache of equal-sized objects, usually of one type.
+typedef struct slab_cache {
+	const char	*name;		// For statistics and debugging
+	size_t		size;		// Object size including padding
+	void		(*ctor)(void *obj); // Object constructor, or NULL
+	int		perslab;	// Objects per slab
+	int		offset;		// Offset of first object in each slab
+
+	spinlock	lock;		// Protects the slab lists below
+	struct slab	*partial;	// Slabs with some objects free
+	struct slab	*full;		// Slabs with no objects free
+	struct slab	*empty;		// At most one slab kept all free
+	uint32_t	nslab;		// Total slabs owned by this cache
+	uint32_t	ngrow;		// Slabs ever allocated
+	uint32_t	nshrink;	// Slabs ever returned to mem_free()
+
+	struct slab_cache *next;	// Next on list of all caches
+	int		idx;		// Index of our per-CPU caches
+} slab_cache;
+
+
+// Set up the kmalloc() size classes and check the slab allocator.
+void slab_init(void);
+
+// Initialize a cache of objects of a given size and minimum alignment,
+// and add it to the list of caches that slab_print() reports on.
+// Each cache may be initialized only once, and never goes away.
+// If ctor is non-NULL, it is called once on each object
+// when its slab is first allocated, not on every slab_alloc();
+// objects must be returned to slab_free() in their constructed state.
+void slab_cache_init(slab_cache *sc, const char *name, size_t size,
+			size_t align, void (*ctor)(void *obj));
+
+// Allocate an object from a cache, or return NULL if out of memory.
+void *slab_alloc(slab_cache *sc);
+
+// Return an object to the cache it was allocated from.
+void slab_free(slab_cache *sc, void *obj);
+
+// Allocate and free small (up to KMALLOC_MAX bytes) untyped memory blocks,
+// out of a set of power-of-two size classes.
+#define KMALLOC_MIN	16
+#define KMALLOC_MAX	2048
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+// Print usage statistics for every slab cache.
+void slab_print(void);
+
+
+#endif /* !PIOS_KERN_SLAB_H */
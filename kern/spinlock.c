@@ -0,0 +1,327 @@
+/*
+ * Spin locks for multiprocessor mutual exclusion in the kernel.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/cons.h>
+#include <kern/init.h>
+#include <kern/spinlock.h>
+
+
+static lockstats *lock_all;		// List of all initialized locks
+static volatile uint32_t lock_alllock;	// Protects lock_all
+
+// Each CPU's MCS queue nodes, and a bitmap of those in use.
+static PERCPU_DEFINE(mcsnode, mcs_node[MCS_MAXNODE]);
+static PERCPU_DEFINE(uint32_t, mcs_nodeused);
+
+
+// Fill in a lock's identification and put it on the list of all locks,
+// unless it's there already from an earlier initialization.
+static void
+lockstats_init(lockstats *st, const char *file, int line, char kind)
+{
+	while (xchg(&lock_alllock, 1) != 0)
+		pause();
+	lockstats *l;
+	for (l = lock_all; l != NULL && l != st; l = l->next)
+		;
+	bool listed = l != NULL;
+	lockstats *next = listed ? st->next : lock_all;
+	memset(st, 0, sizeof(*st));
+	st->file = file;
+	st->line = line;
+	st->kind = kind;
+	st->next = next;
+	if (!listed)
+		lock_all = st;
+	xchg(&lock_alllock, 0);
+}
+
+// Record an acquisition of a lock, which the caller now holds,
+// after waiting since t0 if t0 is nonzero.
+static gcc_inline void
+lockstats_acquired(lockstats *st, uint64_t t0, uint32_t eip)
+{
+#ifndef LOCK_NOSTATS
+	st->nacquire++;
+	if (t0 != 0) {
+		uint32_t cyc = rdtsc() - t0;
+		st->ncontend++;
+		st->spincyc += cyc;
+		if (cyc > st->maxspin)
+			st->maxspin = cyc;
+
+		// The previous holder left its EIP behind:
+		// count it, replacing the least-counted EIP if it's new.
+		int i, min = 0;
+		for (i = 0; i < LOCK_NEIP && st->holdeip[i] != st->eip; i++)
+			if (st->holdcnt[i] < st->holdcnt[min])
+				min = i;
+		if (i == LOCK_NEIP) {
+			i = min;
+			st->holdeip[i] = st->eip;
+			st->holdcnt[i] = 0;
+		}
+		st->holdcnt[i]++;
+	}
+#endif
+	st->eip = eip;
+	st->cpu = cpu_cur();
+}
+
+
+void
+spinlock_init_(spinlock *lk, const char *file, int line)
+{
+	lk->next = 0;
+	lk->serving = 0;
+	lockstats_init(&lk->st, file, line, 'T');
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+void
+spinlock_acquire(spinlock *lk)
+{
+	if (spinlock_holding(lk))
+		panic("spinlock_acquire: already holding lock from %s:%d",
+			lk->st.file, lk->st.line);
+
+	// The xadd is atomic and serializes, so subsequent reads
+	// of memory protected by the lock can't move before it.
+	uint32_t t = xadd(&lk->next, 1);
+	uint64_t t0 = 0;
+	if (lk->serving != t) {
+		t0 = rdtsc();
+		while (lk->serving != t)
+			pause();
+	}
+
+	lockstats_acquired(&lk->st, t0,
+			(uint32_t) __builtin_return_address(0));
+}
+
+// Release the lock.
+void
+spinlock_release(spinlock *lk)
+{
+	if (!spinlock_holding(lk))
+		panic("spinlock_release: not holding lock from %s:%d",
+			lk->st.file, lk->st.line);
+
+	lk->st.cpu = NULL;
+
+	// Only the holder writes serving, and x86 doesn't reorder stores
+	// with earlier loads or stores, so a plain store releases the lock;
+	// the asm just keeps the compiler from reordering.
+	asm volatile("" ::: "memory");
+	lk->serving = lk->serving + 1;
+}
+
+// Check whether this cpu is holding the lock.
+int
+spinlock_holding(spinlock *lk)
+{
+	return lk->next != lk->serving && lk->st.cpu == cpu_cur();
+}
+
+
+void
+mcslock_init_(mcslock *lk, const char *file, int line)
+{
+	lk->tail = NULL;
+	lk->holder = NULL;
+	lockstats_init(&lk->st, file, line, 'M');
+}
+
+void
+mcslock_acquire(mcslock *lk)
+{
+	if (mcslock_holding(lk))
+		panic("mcslock_acquire: already holding lock from %s:%d",
+			lk->st.file, lk->st.line);
+
+	// Grab a free queue node of our own.
+	uint32_t *used = &percpu(mcs_nodeused);
+	int i;
+	for (i = 0; i < MCS_MAXNODE && (*used & (1 << i)); i++)
+		;
+	if (i == MCS_MAXNODE)
+		panic("mcslock_acquire: holding too many MCS locks");
+	*used |= 1 << i;
+	mcsnode *me = &percpu(mcs_node)[i];
+	me->next = NULL;
+	me->locked = 1;
+
+	// Join the tail of the queue, and wait for our predecessor, if any,
+	// to hand the lock to us.
+	uint64_t t0 = 0;
+	mcsnode *pred = (mcsnode*) xchg((volatile uint32_t*) &lk->tail,
+					(uint32_t) me);
+	if (pred != NULL) {
+		t0 = rdtsc();
+		pred->next = me;
+		while (me->locked)
+			pause();
+	}
+
+	lk->holder = me;
+	lockstats_acquired(&lk->st, t0,
+			(uint32_t) __builtin_return_address(0));
+}
+
+void
+mcslock_release(mcslock *lk)
+{
+	if (!mcslock_holding(lk))
+		panic("mcslock_release: not holding lock from %s:%d",
+			lk->st.file, lk->st.line);
+
+	mcsnode *me = lk->holder;
+	lk->holder = NULL;
+	lk->st.cpu = NULL;
+
+	// If no one's queued behind us, just empty the queue.
+	// If someone is just now joining it, wait until they link to us.
+	if (me->next == NULL) {
+		if (cmpxchg((volatile uint32_t*) &lk->tail,
+				(uint32_t) me, 0) == (uint32_t) me)
+			goto done;
+		while (me->next == NULL)
+			pause();
+	}
+	asm volatile("" ::: "memory");
+	me->next->locked = 0;		// hand over the lock
+
+done:
+	percpu(mcs_nodeused) &= ~(1 << (me - &percpu(mcs_node)[0]));
+}
+
+int
+mcslock_holding(mcslock *lk)
+{
+	return lk->holder != NULL && lk->st.cpu == cpu_cur();
+}
+
+
+void
+spinlock_stats(void)
+{
+#ifndef LOCK_NOSTATS
+	// Print the most contended locks first, by total cycles spent waiting,
+	// skipping those no one has ever had to wait for.
+	uint64_t last = ~0ULL;
+	lockstats *l;
+	int n, i;
+
+	cprintf("lock  %-22s %9s %8s %12s %9s  %s\n", "initialized at",
+		"acquires", "contends", "spin cycles", "max spin",
+		"waited-for holders");
+	for (n = 0; n < 20; n++) {
+		lockstats *best = NULL;
+		for (l = lock_all; l != NULL; l = l->next)
+			if (l->ncontend > 0 && l->spincyc < last
+					&& (best == NULL
+					    || l->spincyc > best->spincyc))
+				best = l;
+		if (best == NULL)
+			break;
+		last = best->spincyc;
+
+		cprintf("%c  %18s:%-5d %9u %8u %12llu %9u ", best->kind,
+			best->file, best->line, best->nacquire,
+			best->ncontend, best->spincyc, best->maxspin);
+		for (i = 0; i < LOCK_NEIP; i++)
+			if (best->holdcnt[i] != 0)
+				cprintf(" %08x:%u", best->holdeip[i],
+					best->holdcnt[i]);
+		cprintf("\n");
+	}
+	if (n == 0)
+		cprintf("(no lock contention yet)\n");
+#else
+	cprintf("spinlock_stats: compiled with LOCK_NOSTATS\n");
+#endif
+}
+
+
+#define LOCK_CHECK_ROUNDS	1000	// Acquires per CPU per lock type
+#define LOCK_BENCH_ROUNDS	100000	// Same, when timing with "bench"
+
+static spinlock spinlock_checklock;
+static mcslock mcslock_checklock;
+static volatile uint32_t lock_checkcount;
+
+// Check that both kinds of lock provide mutual exclusion
+// with all CPUs hammering on them at once,
+// using an unprotected read-modify-write that would lose updates otherwise,
+// and with "bench", report how long each kind took.
+// Called on every CPU once all are running.
+void
+spinlock_check(void)
+{
+	int ncpu = cpu_count(), i;
+	bool bench = boot_option("bench");
+	int rounds = bench ? LOCK_BENCH_ROUNDS : LOCK_CHECK_ROUNDS;
+
+	if (cpu_onboot()) {
+		spinlock_init(&spinlock_checklock);
+		mcslock_init(&mcslock_checklock);
+		lock_checkcount = 0;
+	}
+
+	cpu_barrier();
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < rounds; i++) {
+		spinlock_acquire(&spinlock_checklock);
+		assert(spinlock_holding(&spinlock_checklock));
+		lock_checkcount = lock_checkcount + 1;
+		spinlock_release(&spinlock_checklock);
+	}
+	uint64_t tcyc = rdtsc() - t0;
+	cpu_barrier();
+	assert(lock_checkcount == ncpu * rounds);
+	assert(!spinlock_holding(&spinlock_checklock));
+	cpu_barrier();
+
+	if (cpu_onboot())
+		lock_checkcount = 0;
+	cpu_barrier();
+	t0 = rdtsc();
+	for (i = 0; i < rounds; i++) {
+		mcslock_acquire(&mcslock_checklock);
+		assert(mcslock_holding(&mcslock_checklock));
+		lock_checkcount = lock_checkcount + 1;
+		mcslock_release(&mcslock_checklock);
+	}
+	uint64_t mcyc = rdtsc() - t0;
+	cpu_barrier();
+	assert(lock_checkcount == ncpu * rounds);
+	assert(!mcslock_holding(&mcslock_checklock));
+	assert(percpu(mcs_nodeused) == 0);
+
+	if (!cpu_onboot())
+		return;
+
+	if (bench) {
+		cprintf("spinlock_check: %d CPU(s): "
+			"ticket lock %u cycles/acquire, "
+			"MCS lock %u cycles/acquire\n", ncpu,
+			(uint32_t) (tcyc / rounds), (uint32_t) (mcyc / rounds));
+		spinlock_stats();
+	}
+	cons_hotkey(CONS_HOTKEY('L'), spinlock_stats,
+			"lock contention statistics");
+	cprintf("spinlock_check() succeeded!\n");
+}
@@ -0,0 +1,102 @@
+/*
+ * Spin locks for multiprocessor mutual exclusion in the kernel.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_SPINLOCK_H
+#define PIOS_KERN_SPINLOCK_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// Define LOCK_NOSTATS to compile out lock contention statistics.
+#define LOCK_NEIP	4	// Holder EIPs tracked per lock
+
+// Identification and contention statistics every lock carries.
+// All locks get chained onto a global list when initialized,
+// so that spinlock_stats() can find the contended ones on a live system.
+typedef struct lockstats {
+	const char	*file;		// Source file where lock was initialized
+	int		line;		// Line number of spinlock_init()
+	char		kind;		// 'T' for ticket lock, 'M' for MCS lock
+	struct lockstats *next;		// Next on the list of all locks
+	struct cpu	*cpu;		// The cpu holding the lock
+	uint32_t	eip;		// Where the current holder acquired it
+
+#ifndef LOCK_NOSTATS
+	uint32_t	nacquire;	// Number of acquisitions
+	uint32_t	ncontend;	// Acquisitions that had to wait
+	uint64_t	spincyc;	// Total cycles spent waiting
+	uint32_t	maxspin;	// Longest single wait, in cycles
+
+	// Where the holders we had to wait for acquired the lock,
+	// and how many times we waited for each.
+	uint32_t	holdeip[LOCK_NEIP];
+	uint32_t	holdcnt[LOCK_NEIP];
+#endif
+} lockstats;
+
+
+// Fair ticket lock, for lightly contended paths:
+// CPUs get the lock in the order they asked for it,
+// but all waiters spin on the same cache line.
+typedef struct spinlock {
+	volatile uint32_t next;		// Next ticket to hand out
+	volatile uint32_t serving;	// Ticket now holding the lock
+	lockstats	st;
+} spinlock;
+
+// Initialize a spinlock, recording where it was initialized for debugging.
+#define spinlock_init(lk)	spinlock_init_(lk, __FILE__, __LINE__)
+void spinlock_init_(spinlock *lk, const char *file, int line);
+
+// Acquire the lock, spinning until it becomes available.
+// Holding a lock for a long time may cause other CPUs to waste time spinning.
+void spinlock_acquire(spinlock *lk);
+
+// Release the lock.
+void spinlock_release(spinlock *lk);
+
+// Check whether this cpu is holding the lock.
+int spinlock_holding(spinlock *lk);
+
+
+// Queue node for MCS locks.  Each CPU has a few of these,
+// one for each MCS lock it may hold or wait for at once.
+#define MCS_MAXNODE	4
+typedef struct mcsnode {
+	struct mcsnode *volatile next;	// Next waiter in the queue
+	volatile uint32_t locked;	// Nonzero while we must wait
+} gcc_aligned(64) mcsnode;
+
+// MCS queue lock (Mellor-Crummey and Scott), for heavily contended paths:
+// fair like a ticket lock, but each waiter spins on its own queue node,
+// so a release touches only the next waiter's cache line.
+typedef struct mcslock {
+	mcsnode *volatile tail;		// Last node in the queue, or NULL
+	mcsnode		*holder;	// Queue node of the current holder
+	lockstats	st;
+} mcslock;
+
+#define mcslock_init(lk)	mcslock_init_(lk, __FILE__, __LINE__)
+void mcslock_init_(mcslock *lk, const char *file, int line);
+void mcslock_acquire(mcslock *lk);
+void mcslock_release(mcslock *lk);
+int mcslock_holding(mcslock *lk);
+
+
+// Print contention statistics for the most contended locks.
+void spinlock_stats(void);
+
+// Check both kinds of lock, from all CPUs at once.
+void spinlock_check(void);
+
+
+#endif /* !PIOS_KERN_SPINLOCK_H */
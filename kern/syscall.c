@@ -0,0 +1,123 @@
+/*
+ * System call handling.
+ * User code can enter the kernel with "int $T_SYSCALL", which works
+ * everywhere, or with SYSENTER, which avoids the IDT lookup,
+ * the privilege checks of a gate, the full trapframe, and the IRET.
+ * Both paths end up in syscall_dispatch().
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/syscall.h>
+
+#include <kern/cpu.h>
+#include <kern/trap.h>
+#include <kern/cons.h>
+#include <kern/syscall.h>
+
+
+bool
+syscall_hasfast(void)
+{
+	// The Pentium Pro reports SEP but doesn't really have SYSENTER.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	int family = (inf.eax >> 8) & 0xf, model = (inf.eax >> 4) & 0xf;
+	int stepping = inf.eax & 0xf;
+	return (inf.edx & CPUID_EDX_SEP)
+		&& !(family == 6 && model < 3 && stepping < 3);
+}
+
+void
+syscall_init(void)
+{
+	extern char sysenter_entry[];
+
+	if (!syscall_hasfast())
+		return;
+
+	// SYSENTER loads CS from MSR_SYSENTER_CS and SS from the next
+	// descriptor; SYSEXIT loads user CS and SS from the two after that.
+	// Our GDT is laid out accordingly (see kern/cpu.h).
+	static_assert(CPU_GDT_KDATA == CPU_GDT_KCODE + 8);
+	static_assert(CPU_GDT_UCODE == CPU_GDT_KCODE + 16);
+	static_assert(CPU_GDT_UDATA == CPU_GDT_KCODE + 24);
+	cpu *c = cpu_cur();
+	wrmsr(MSR_SYSENTER_CS, CPU_GDT_KCODE);
+	wrmsr(MSR_SYSENTER_ESP, (uint32_t) c->kstackhi);
+	wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
+uint32_t
+syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	switch (num) {
+	case SYS_NULL:
+		return 0;
+	case SYS_CPUTS:
+		// No user address spaces yet, so there's nothing to check.
+		cprintf("%s", (const char *) a1);
+		return 0;
+	case SYS_CGETC:
+		// Polling from here, not user mode, lets hotkeys use cpu_cur().
+		return cons_getc();
+	default:
+		return SYS_EINVAL;
+	}
+}
+
+void gcc_noreturn
+syscall(trapframe *tf)
+{
+	tf->regs.eax = syscall_dispatch(tf->regs.eax, tf->regs.ebx,
+					tf->regs.esi, tf->regs.edi);
+	trap_return(tf);
+}
+
+
+#define SYSCALL_CHECK_ROUNDS	100000
+
+// Called from user() in kern/init.c, in user mode.
+// We can't use cpu_cur() or anything else that uses %gs here.
+void
+syscall_check(void)
+{
+	bool fast = syscall_hasfast();
+	int i;
+
+	// Both paths should do the same thing.
+	assert(syscall_int(SYS_NULL, 0, 0, 0) == 0);
+	assert(syscall_int(SYS_NCALLS, 0, 0, 0) == SYS_EINVAL);
+	syscall_int(SYS_CPUTS, (uint32_t) "syscall_check: int works\n", 0, 0);
+	if (fast) {
+		assert(syscall_sysenter(SYS_NULL, 0, 0, 0) == 0);
+		assert(syscall_sysenter(SYS_NCALLS, 0, 0, 0) == SYS_EINVAL);
+		syscall_sysenter(SYS_CPUTS,
+			(uint32_t) "syscall_check: sysenter works\n", 0, 0);
+	}
+
+	// Time null system call round trips on each path.
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < SYSCALL_CHECK_ROUNDS; i++)
+		syscall_int(SYS_NULL, 0, 0, 0);
+	uint64_t icyc = rdtsc() - t0;
+	cprintf("syscall_check: null syscall via int: %u cycles\n",
+		(uint32_t) (icyc / SYSCALL_CHECK_ROUNDS));
+	if (fast) {
+		t0 = rdtsc();
+		for (i = 0; i < SYSCALL_CHECK_ROUNDS; i++)
+			syscall_sysenter(SYS_NULL, 0, 0, 0);
+		uint64_t scyc = rdtsc() - t0;
+		cprintf("syscall_check: null syscall via sysenter: "
+			"%u cycles\n", (uint32_t) (scyc / SYSCALL_CHECK_ROUNDS));
+	} else
+		cprintf("syscall_check: no SYSENTER on this processor\n");
+
+	cprintf("syscall_check() succeeded!\n");
+}
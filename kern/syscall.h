@@ -0,0 +1,38 @@
+/*
+ * Kernel system call handling.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_SYSCALL_H
+#define PIOS_KERN_SYSCALL_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/trap.h>
+
+
+// Returns true if this processor supports SYSENTER,
+// in which case cpu_init() sets it up.  Works in user mode too.
+bool syscall_hasfast(void);
+
+// Set up the current CPU's MSRs for SYSENTER, if it supports it.
+// Called from cpu_init().
+void syscall_init(void);
+
+// Handle a system call made through the T_SYSCALL trap gate.
+void syscall(trapframe *tf) gcc_noreturn;
+
+// Carry out system call num with the given arguments: used by both
+// the trap gate path above and the SYSENTER path in kern/trapasm.S.
+uint32_t syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3);
+
+// Check both system call paths from user mode, and compare their costs.
+void syscall_check(void);
+
+
+#endif /* !PIOS_KERN_SYSCALL_H */
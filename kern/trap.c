@@ -16,6 +16,7 @@
 #include <kern/trap.h>
 #include <kern/cons.h>
 #include <kern/init.h>
+#include <kern/syscall.h>
 
 
 // Interrupt descriptor table.  Must be built at run time because
@@ -28,13 +29,75 @@ static struct pseudodesc idt_pd = {
 	sizeof(idt) - 1, (uint32_t) idt
 };
 
+// Handler for each vector, indexed by trap number; NULL if unexpected.
+static trap_handler trap_handlers[256];
+
+// Each CPU's trap statistics, and a stack of the traps it's now in,
+// so that trap_exit() can tell how long each one took.
+#define TRAP_MAXNEST	4		// Nested traps we time
+typedef struct trap_inflight {
+	trapframe	*tf;		// Trapframe trap() was called with
+	uint64_t	t0;		// When trap() was called
+} trap_inflight;
+static PERCPU_DEFINE(trap_vecstats, trap_vstats[256]);
+static PERCPU_DEFINE(trap_inflight, trap_nest[TRAP_MAXNEST]);
+static PERCPU_DEFINE(int, trap_depth);
+
 
 static void
 trap_init_idt(void)
 {
-	extern segdesc gdt[];
-	
-	panic("trap_init() not implemented.");
+	extern char trap_divide[], trap_debug[], trap_nmi[], trap_brkpt[],
+		trap_oflow[], trap_bound[], trap_illop[], trap_device[],
+		trap_dblflt[], trap_tss[], trap_segnp[], trap_stack[],
+		trap_gpflt[], trap_pgflt[], trap_fperr[], trap_align[],
+		trap_mchk[], trap_simd[], trap_secev[],
+		trap_irq0[], trap_irq1[], trap_irq2[], trap_irq3[],
+		trap_irq4[], trap_irq5[], trap_irq6[], trap_irq7[],
+		trap_irq8[], trap_irq9[], trap_irq10[], trap_irq11[],
+		trap_irq12[], trap_irq13[], trap_irq14[], trap_irq15[],
+		trap_syscall[], trap_ltimer[], trap_lerror[], trap_default[];
+	static char *const irqs[16] = {
+		trap_irq0, trap_irq1, trap_irq2, trap_irq3,
+		trap_irq4, trap_irq5, trap_irq6, trap_irq7,
+		trap_irq8, trap_irq9, trap_irq10, trap_irq11,
+		trap_irq12, trap_irq13, trap_irq14, trap_irq15,
+	};
+	int i;
+
+	// Anything we don't expect goes to the default handler.
+	for (i = 0; i < 256; i++)
+		SETGATE(idt[i], 0, CPU_GDT_KCODE, trap_default, 0);
+
+	// Processor exceptions.  Breakpoint, overflow, and bounds traps
+	// can be raised on purpose by int3, into, and bound instructions,
+	// so allow those from user mode.
+	SETGATE(idt[T_DIVIDE], 0, CPU_GDT_KCODE, trap_divide, 0);
+	SETGATE(idt[T_DEBUG], 0, CPU_GDT_KCODE, trap_debug, 0);
+	SETGATE(idt[T_NMI], 0, CPU_GDT_KCODE, trap_nmi, 0);
+	SETGATE(idt[T_BRKPT], 0, CPU_GDT_KCODE, trap_brkpt, 3);
+	SETGATE(idt[T_OFLOW], 0, CPU_GDT_KCODE, trap_oflow, 3);
+	SETGATE(idt[T_BOUND], 0, CPU_GDT_KCODE, trap_bound, 3);
+	SETGATE(idt[T_ILLOP], 0, CPU_GDT_KCODE, trap_illop, 0);
+	SETGATE(idt[T_DEVICE], 0, CPU_GDT_KCODE, trap_device, 0);
+	SETGATE(idt[T_DBLFLT], 0, CPU_GDT_KCODE, trap_dblflt, 0);
+	SETGATE(idt[T_TSS], 0, CPU_GDT_KCODE, trap_tss, 0);
+	SETGATE(idt[T_SEGNP], 0, CPU_GDT_KCODE, trap_segnp, 0);
+	SETGATE(idt[T_STACK], 0, CPU_GDT_KCODE, trap_stack, 0);
+	SETGATE(idt[T_GPFLT], 0, CPU_GDT_KCODE, trap_gpflt, 0);
+	SETGATE(idt[T_PGFLT], 0, CPU_GDT_KCODE, trap_pgflt, 0);
+	SETGATE(idt[T_FPERR], 0, CPU_GDT_KCODE, trap_fperr, 0);
+	SETGATE(idt[T_ALIGN], 0, CPU_GDT_KCODE, trap_align, 0);
+	SETGATE(idt[T_MCHK], 0, CPU_GDT_KCODE, trap_mchk, 0);
+	SETGATE(idt[T_SIMD], 0, CPU_GDT_KCODE, trap_simd, 0);
+	SETGATE(idt[T_SECEV], 0, CPU_GDT_KCODE, trap_secev, 0);
+
+	// Hardware interrupts, the system call vector, and local APIC vectors.
+	for (i = 0; i < 16; i++)
+		SETGATE(idt[T_IRQ0+i], 0, CPU_GDT_KCODE, irqs[i], 0);
+	SETGATE(idt[T_SYSCALL], 0, CPU_GDT_KCODE, trap_syscall, 3);
+	SETGATE(idt[T_LTIMER], 0, CPU_GDT_KCODE, trap_ltimer, 0);
+	SETGATE(idt[T_LERROR], 0, CPU_GDT_KCODE, trap_lerror, 0);
 }
 
 void
@@ -42,8 +105,14 @@ trap_init(void)
 {
 	// The first time we get called on the bootstrap processor,
 	// initialize the IDT.  Other CPUs will share the same IDT.
-	if (cpu_onboot())
+	if (cpu_onboot()) {
+		static_assert(sizeof(trapframe) == SIZEOF_STRUCT_TRAPFRAME);
+		static_assert(offsetof(trapframe, gs) == OFFSETOF_TRAPFRAME_GS);
 		trap_init_idt();
+		trap_register(T_SYSCALL, syscall);
+		cons_hotkey(CONS_HOTKEY('T'), trap_stats,
+				"trap counts and cycles by vector");
+	}
 
 	// Load the IDT into this processor's IDT register.
 	asm volatile("lidt %0" : : "m" (idt_pd));
@@ -80,6 +149,14 @@ const char *trap_name(int trapno)
 
 	if (trapno < sizeof(excnames)/sizeof(excnames[0]))
 		return excnames[trapno];
+	if (trapno >= T_IRQ0 && trapno < T_IRQ0 + 16)
+		return "Hardware Interrupt";
+	if (trapno == T_SYSCALL)
+		return "System call";
+	if (trapno == T_LTIMER)
+		return "Local APIC timer";
+	if (trapno == T_LERROR)
+		return "Local APIC error";
 	return "(unknown trap)";
 }
 
@@ -112,22 +189,164 @@ trap_print(trapframe *tf)
 	cprintf("  ss   0x----%04x\n", tf->ss);
 }
 
+// Count a trap, and remember when it started so that trap_exit()
+// can record how long it took.
+static gcc_inline void
+trap_enter(cpu *c, trapframe *tf, uint64_t t0)
+{
+#ifndef TRAP_NOSTATS
+	if (tf->trapno >= 256)
+		return;
+	percpu_on(c, trap_vstats)[tf->trapno].count++;
+	int *d = &percpu_on(c, trap_depth);
+	if (*d < TRAP_MAXNEST) {
+		percpu_on(c, trap_nest)[*d].tf = tf;
+		percpu_on(c, trap_nest)[*d].t0 = t0;
+		++*d;
+	}
+#endif
+}
+
+void
+trap_exit(trapframe *tf)
+{
+	uint64_t t1 = rdtsc();
+	cpu *c = cpu_cur();
+	int *d = &percpu_on(c, trap_depth);
+	trap_inflight *nest = percpu_on(c, trap_nest);
+
+	// Nested traps whose frames lie below this one on the stack
+	// aren't coming back (e.g., a recover handler diverted them).
+	while (*d > 0 && nest[*d-1].tf < tf)
+		--*d;
+	if (*d == 0 || nest[*d-1].tf != tf)
+		return;		// not returning from a trap we timed
+	--*d;
+
+	trap_vecstats *st = &percpu_on(c, trap_vstats)[tf->trapno];
+	uint32_t cyc = t1 - nest[*d].t0;
+	int b = 0;
+	if (cyc != 0)
+		asm("bsrl %1,%0" : "=r" (b) : "rm" (cyc));
+	st->hist[MIN(b, TRAP_NHIST-1)]++;
+	st->cycles += cyc;
+	if (cyc > st->maxcyc)
+		st->maxcyc = cyc;
+}
+
 void gcc_noreturn
 trap(trapframe *tf)
 {
+	uint64_t t0 = rdtsc();
+
 	// The user-level environment may have set the DF flag,
 	// and some versions of GCC rely on DF being clear.
 	asm volatile("cld" ::: "cc");
 
-	// If this trap was anticipated, just use the designated handler.
+	// _alltraps loaded our per-CPU segment into %gs, so cpu_cur() works;
+	// but check the cpu struct's magic here, once per trap,
+	// to catch kernel stack overflows onto it.
 	cpu *c = cpu_cur();
+	assert(c->magic == CPU_MAGIC);
+	trap_enter(c, tf, t0);
+
+	// If this trap was anticipated, just use the designated handler.
 	if (c->recover)
 		c->recover(tf, c->recoverdata);
 
+	// Otherwise, send it straight to whatever handles this vector.
+	// Unused vectors produce T_DEFAULT, which is off the end of the table.
+	trap_handler h = tf->trapno < 256 ? trap_handlers[tf->trapno] : NULL;
+	if (h != NULL) {
+		h(tf);
+		trap_return(tf);
+	}
+
 	trap_print(tf);
 	panic("unhandled trap");
 }
 
+// Called from the trap_ltimer entry code in trapasm.S instead of trap(),
+// for interrupts that may arrive while the kernel is in the middle of
+// anything, including trap() itself or code running with a recover handler.
+void
+trap_direct(trapframe *tf)
+{
+	trap_handler h = trap_handlers[tf->trapno];
+	if (h == NULL) {
+		trap_print(tf);
+		panic("unhandled interrupt");
+	}
+	h(tf);
+}
+
+void
+trap_register(int trapno, trap_handler h)
+{
+	assert(trapno >= 0 && trapno < 256);
+	trap_handlers[trapno] = h;
+}
+
+// Print the vectors that have taken the most cycles, summed over all CPUs,
+// with a log2 histogram of how long each trap through them took.
+// Reads other CPUs' counters without synchronization,
+// so the numbers may be slightly stale, but never unsafe to print.
+void
+trap_stats(void)
+{
+#ifndef TRAP_NOSTATS
+	bool shown[256] = { 0 };
+	cpu *c;
+	int n, v, b;
+
+	cprintf("trap_stats: vec %-28s %9s %12s %8s %9s\n", "name",
+		"count", "cycles", "avg", "max");
+	for (n = 0; n < 10; n++) {
+		trap_vecstats sum = { 0 };
+		int best = -1;
+		for (v = 0; v < 256; v++) {
+			trap_vecstats vs = { 0 };
+			for (c = &cpu_boot; c != NULL; c = c->next) {
+				trap_vecstats *st = &percpu_on(c, trap_vstats)[v];
+				vs.count += st->count;
+				vs.cycles += st->cycles;
+				vs.maxcyc = MAX(vs.maxcyc, st->maxcyc);
+			}
+			if (!shown[v] && vs.count > 0 && (best < 0
+					|| vs.cycles > sum.cycles)) {
+				best = v;
+				sum = vs;
+			}
+		}
+		if (best < 0)
+			break;
+		shown[best] = 1;
+
+		cprintf("trap_stats: %3d %-28s %9u %12llu %8u %9u\n", best,
+			trap_name(best), sum.count, sum.cycles,
+			(uint32_t) (sum.cycles / sum.count), sum.maxcyc);
+		cprintf("trap_stats:     cycles:");
+		for (b = 0; b < TRAP_NHIST; b++) {
+			uint32_t cnt = 0;
+			for (c = &cpu_boot; c != NULL; c = c->next)
+				cnt += percpu_on(c, trap_vstats)[best].hist[b];
+			if (cnt == 0)
+				continue;
+			if (b == TRAP_NHIST-1)
+				cprintf(" %u+:%u", 1u << b, cnt);
+			else
+				cprintf(" %u-%u:%u", b ? 1u << b : 0,
+					(2u << b) - 1, cnt);
+		}
+		cprintf("\n");
+	}
+	if (n == 0)
+		cprintf("(no traps yet)\n");
+#else
+	cprintf("trap_stats: compiled with TRAP_NOSTATS\n");
+#endif
+}
+
 
 // Helper function for trap_check_recover(), below:
 // handles "anticipated" traps by simply resuming at a new EIP.
@@ -140,6 +359,35 @@ trap_check_recover(trapframe *tf, void *recoverdata)
 	trap_return(tf);
 }
 
+#define TRAP_CHECK_ROUNDS	100	// int3s to check handler registration
+#define TRAP_BENCH_ROUNDS	10000	// int3s to time, with "bench"
+
+static int trap_check_count;
+
+// Registered handler for trap_check_time(): just counts breakpoints,
+// and lets trap() resume after the int3.
+static void
+trap_check_handler(trapframe *tf)
+{
+	assert(tf->trapno == T_BRKPT);
+	trap_check_count++;
+}
+
+uint64_t
+trap_check_time(int rounds)
+{
+	int i;
+	trap_check_count = 0;
+	trap_register(T_BRKPT, trap_check_handler);
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < rounds; i++)
+		asm volatile("int3");
+	uint64_t cyc = rdtsc() - t0;
+	assert(trap_check_count == rounds);
+	trap_register(T_BRKPT, NULL);
+	return cyc;
+}
+
 // Check for correct handling of traps from kernel mode.
 // Called on the boot CPU after trap_init() and trap_setup().
 void
@@ -152,6 +400,10 @@ trap_check_kernel(void)
 	trap_check(&c->recoverdata);
 	c->recover = NULL;	// No more mr. nice-guy; traps are real again
 
+	// Boot options aren't known yet this early,
+	// so bench_run() times kernel-to-kernel traps instead.
+	trap_check_time(TRAP_CHECK_ROUNDS);
+
 	cprintf("trap_check_kernel() succeeded!\n");
 }
 
@@ -164,11 +416,19 @@ trap_check_user(void)
 {
 	assert((read_cs() & 3) == 3);	// better be in user mode!
 
-	cpu *c = &cpu_boot;	// cpu_cur doesn't work from user mode!
+	cpu *c = &cpu_boot;	// %gs, and so cpu_cur, is kernel-only!
 	c->recover = trap_check_recover;
 	trap_check(&c->recoverdata);
 	c->recover = NULL;	// No more mr. nice-guy; traps are real again
 
+	if (boot_option("bench")) {
+		cprintf("trap_check_user: user-to-kernel trap: %u cycles\n",
+			(uint32_t) (trap_check_time(TRAP_BENCH_ROUNDS)
+					/ TRAP_BENCH_ROUNDS));
+		trap_stats();
+	} else
+		trap_check_time(TRAP_CHECK_ROUNDS);
+
 	cprintf("trap_check_user() succeeded!\n");
 }
 
@@ -33,6 +33,38 @@ typedef struct trap_check_args {
 // Initialize the trap-handling module and the processor's IDT.
 void trap_init(void);
 
+// A handler for one trap vector, called by trap() with the trapframe.
+// It may resume the trapping code with trap_return(), or simply return,
+// in which case trap() does that for it.
+typedef void (*trap_handler)(trapframe *tf);
+
+// Make trap() send traps through vector trapno to handler h,
+// or treat them as unexpected again if h is NULL.
+// All CPUs share the same handlers.
+// The T_LTIMER handler is instead called by trap_direct(), below,
+// and must return rather than call trap_return().
+void trap_register(int trapno, trap_handler h);
+
+// Run the handler for an interrupt that bypasses trap() (see trapasm.S):
+// no trap statistics, no recover handler, and no way not to return.
+void trap_direct(trapframe *tf);
+
+// Per-CPU, per-vector trap statistics, kept by trap() and trap_return.
+// Define TRAP_NOSTATS to compile them out.
+#define TRAP_NHIST	20	// Log2 buckets of cycles in trap
+typedef struct trap_vecstats {
+	uint64_t	cycles;		// Total cycles from trap() to return
+	uint32_t	count;		// Traps through this vector
+	uint32_t	maxcyc;		// Longest single trap, in cycles
+	uint32_t	hist[TRAP_NHIST]; // Cycles, log2-bucketed
+} trap_vecstats;
+
+// Print the vectors that have taken the most cycles on all CPUs.
+void trap_stats(void);
+
+// Called by trap_return to account for the time spent in a trap.
+void trap_exit(trapframe *tf);
+
 // Return a string constant describing a given trap number,
 // or "(unknown trap)" if not known.
 const char *trap_name(int trapno);
@@ -51,4 +83,9 @@ void trap_check_kernel(void);
 void trap_check_user(void);
 void trap_check(void **argsp);
 
+// Check that a handler registered for T_BRKPT gets rounds int3 traps
+// from the current privilege level, and return the total cycles taken.
+// Works in user mode too, since we have no memory protection yet.
+uint64_t trap_check_time(int rounds);
+
 #endif /* PIOS_KERN_TRAP_H */
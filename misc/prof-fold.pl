@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+# Copyright (C) 2010 Yale University.
+# See section "MIT License" in the file LICENSES for licensing terms.
+#
+# Usage: prof-fold.pl [-c] <kernel.sym> [<console-log> ...]
+#
+# This script turns the samples that the kernel's profiler (kern/prof.c)
+# prints over the console into "folded stacks" for flame graph tools:
+# one line per distinct call chain, outermost caller first,
+# with function names separated by semicolons and followed by a count:
+#
+#	init;bench_run;bench_alloc_free;mem_alloc 42
+#
+# It symbolizes each EIP against <kernel.sym>, the "nm -n" listing
+# that kern/Makefrag leaves in obj/kern/kernel.sym,
+# and reads the console output from the named files or standard input,
+# ignoring everything except the "prof: cpu=..." sample lines.
+# Samples taken in user mode get a "[user]" root frame.
+# With -c, each stack also gets a root frame for the CPU it was sampled on.
+#
+# For example:
+#
+#	perl misc/prof-fold.pl obj/kern/kernel.sym serial.log | flamegraph.pl
+#
+
+my $percpu = 0;
+if (@ARGV && $ARGV[0] eq "-c") {
+	$percpu = 1;
+	shift @ARGV;
+}
+@ARGV >= 1 or die "usage: prof-fold.pl [-c] <kernel.sym> [<log> ...]\n";
+my $symfile = shift @ARGV;
+
+# Read the text symbols, already sorted by address.
+my (@addrs, @names);
+open(SYMS, $symfile) or die "prof-fold.pl: can't open $symfile: $!\n";
+while (<SYMS>) {
+	next unless /^([0-9a-fA-F]+) [TtWw] (\S+)$/;
+	push @addrs, hex($1);
+	push @names, $2;
+}
+close(SYMS);
+@addrs or die "prof-fold.pl: no text symbols in $symfile\n";
+
+# Find the name of the function containing addr.
+sub symbolize {
+	my $addr = shift;
+	my ($lo, $hi) = (0, $#addrs);
+	return sprintf("%08x", $addr) if $addr < $addrs[0];
+	while ($lo < $hi) {
+		my $mid = int(($lo + $hi + 1) / 2);
+		if ($addrs[$mid] <= $addr) {
+			$lo = $mid;
+		} else {
+			$hi = $mid - 1;
+		}
+	}
+	return $names[$lo];
+}
+
+my %count;
+while (<>) {
+	next unless /prof: cpu=(\d+) cpl=(\d+)((?: [0-9a-fA-F]{8})+)\s*$/;
+	my ($cpu, $cpl, @eips) = ($1, $2, split(' ', $3));
+
+	# eips[0] is where the timer interrupted; the rest are return addresses,
+	# so look up the call instruction just before each of them.
+	my @frames;
+	for (my $i = 0; $i < @eips; $i++) {
+		push @frames, symbolize(hex($eips[$i]) - ($i > 0 ? 1 : 0));
+	}
+	push @frames, "[user]" if $cpl != 0;
+	push @frames, "cpu$cpu" if $percpu;
+	$count{join(";", reverse @frames)}++;
+}
+
+foreach my $stack (sort { $count{$b} <=> $count{$a} || $a cmp $b }
+			keys %count) {
+	print "$stack $count{$stack}\n";
+}